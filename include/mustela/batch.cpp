@@ -0,0 +1,78 @@
+#include "mustela.hpp"
+
+using namespace mustela;
+
+WriteBatch::WriteBatch(DB & my_db):my_db(my_db), read_tx(my_db, true)
+{}
+
+WriteBatch::RootVersion WriteBatch::get_root_version(TX & txn, const Bucket & bucket){
+	if( !bucket.is_valid() )
+		return RootVersion{0, 0};
+	const Pid root_page = bucket.bucket_desc->root_page;
+	return RootVersion{root_page, txn.readable_page(root_page, 1)->tid()};
+}
+bool WriteBatch::get(const Val & bucket_name, const Val & key, Val * value){
+	auto bit = changes.find(bucket_name.to_string());
+	if( bit != changes.end() ){
+		auto cit = bit->second.find(key.to_string());
+		if( cit != bit->second.end() ){
+			if( cit->second.del )
+				return false;
+			*value = Val(cit->second.value);
+			return true;
+		}
+	}
+	Bucket bucket = read_tx.get_bucket(bucket_name, false);
+	read_roots.insert(std::make_pair(bucket_name.to_string(), get_root_version(read_tx, bucket)));
+	return bucket.is_valid() && bucket.get(key, value);
+}
+void WriteBatch::put(const Val & bucket_name, const Val & key, const Val & value){
+	if(key.size > my_db.max_key_size())
+		Exception::th("Key size too big in WriteBatch::put");
+	Change & ch = changes[bucket_name.to_string()][key.to_string()];
+	ch.del = false;
+	ch.value = value.to_string();
+}
+void WriteBatch::del(const Val & bucket_name, const Val & key){
+	Change & ch = changes[bucket_name.to_string()][key.to_string()];
+	ch.del = true;
+	ch.value.clear();
+}
+bool WriteBatch::commit(){
+	if( changes.empty() ){ // Our reads were from consistent snapshot
+		reset();
+		return true;
+	}
+	{
+		TX txn(my_db);
+		for(auto && rr : read_roots){
+			Bucket bucket = txn.get_bucket(Val(rr.first), false);
+			if( get_root_version(txn, bucket) != rr.second ){
+				conflict_counter += 1;
+				reset(); // txn is destroyed without commit
+				return false;
+			}
+		}
+		for(auto && bu : changes){
+			bool has_puts = false;
+			for(auto && ch : bu.second)
+				has_puts = has_puts || !ch.second.del;
+			Bucket bucket = txn.get_bucket(Val(bu.first), has_puts);
+			if( !bucket.is_valid() )
+				continue;
+			for(auto && ch : bu.second)
+				if( ch.second.del )
+					bucket.del(Val(ch.first));
+				else
+					bucket.put(Val(ch.first), Val(ch.second.value), false);
+		}
+		txn.commit();
+	}
+	reset();
+	return true;
+}
+void WriteBatch::reset(){
+	read_roots.clear();
+	changes.clear();
+	read_tx.renew();
+}
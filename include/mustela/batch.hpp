@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include "tx.hpp"
+
+namespace mustela {
+
+	// Optimistic writer. Reads go to read-only snapshot, changes are buffered in memory,
+	// so many batches can be prepared in parallel. Write lock is taken only inside commit,
+	// which checks that buckets we read were not changed since our snapshot and applies changes.
+	// Buckets we only wrote to never conflict.
+	// WriteBatch batch(db);
+	// do {
+	//     batch.get(...); batch.put(...);
+	// } while( !batch.commit() );
+	class WriteBatch {
+	public:
+		explicit WriteBatch(DB & my_db);
+		Tid tid()const{ return read_tx.tid(); } // of snapshot
+
+		bool get(const Val & bucket_name, const Val & key, Val * value); // sees own changes, value valid until next change
+		void put(const Val & bucket_name, const Val & key, const Val & value);
+		void del(const Val & bucket_name, const Val & key);
+
+		// false if some bucket we read was changed by others, changes are then discarded
+		// in both cases batch is moved to the newest snapshot and is ready for reuse
+		bool commit();
+		void reset(); // discard changes and move to the newest snapshot
+		size_t get_conflict_counter()const{ return conflict_counter; }
+	private:
+		DB & my_db;
+		TX read_tx;
+		// root_page and its tid of each bucket we read from, {0, 0} if bucket did not exist. We compare tid too,
+		// because reader slot can expire while batch is idle, then root page can be freed and reused
+		typedef std::pair<Pid, Tid> RootVersion;
+		std::map<std::string, RootVersion> read_roots;
+		static RootVersion get_root_version(TX & txn, const Bucket & bucket);
+		struct Change {
+			bool del = false;
+			std::string value;
+		};
+		std::map<std::string, std::map<std::string, Change>> changes;
+		size_t conflict_counter = 0;
+	};
+}
+
@@ -56,14 +56,17 @@ char * Bucket::put(const Val & key, size_t value_size, bool nooverwrite){
 	const bool same_key = main_cursor.seek(key);
 //		CLeafPtr dap = my_txn.readable_leaf(main_cursor.path.at(0).first);
 //		bool same_key = item != dap.size() && Val(dap.get_key(item)) == key;
+	if( same_key && nooverwrite )
+		return nullptr;
+	return put_at(main_cursor, same_key, key, value_size);
+}
+char * Bucket::put_at(Cursor & main_cursor, bool same_key, const Val & key, size_t value_size){
 	TX::BucketMirror * bu = nullptr;
 	if(DEBUG_MIRROR && bucket_desc != &my_txn->meta_page.meta_bucket){
 	 	bu = &my_txn->debug_mirror.at(persistent_name.to_string());
 		ass(bu->count(key.to_string()) == size_t(same_key), "Mirror key different in bucket put");
 		my_txn->before_mirror_operation(bucket_desc, persistent_name);
 	}
-	if( same_key && nooverwrite )
-		return nullptr;
 	my_txn->meta_page_dirty = true;
 	// TODO - optimize - if page will split and it is not writable yet, we can save make_page_writable
 	LeafPtr wr_dap(my_txn->page_size, (LeafPage *)my_txn->make_pages_writable(main_cursor, 0));
@@ -87,7 +90,7 @@ char * Bucket::put(const Val & key, size_t value_size, bool nooverwrite){
 	char * result = my_txn->new_insert2leaf(main_cursor, key, value_size, &overflow);
 	if( overflow ){
 		Pid overflow_count = (value_size + my_txn->page_size - 1)/my_txn->page_size;
-		Pid opa = my_txn->get_free_page(overflow_count);
+		Pid opa = my_txn->get_free_page(overflow_count, main_cursor.at(0).pid);
 		bucket_desc->overflow_page_count += overflow_count;
 		pack_uint_le(result, NODE_PID_SIZE, opa);
 		pack_uint_le(result + NODE_PID_SIZE, sizeof(Tid), my_txn->tid());
@@ -115,13 +118,99 @@ bool Bucket::put(const Val & key, const Val & value, bool nooverwrite) { // fals
 	}
 	return dst != nullptr;
 }
-bool Bucket::get(const Val & key, Val * value)const{
+Bucket::Update Bucket::update(const Val & key, const UpdateFunction & fn){
+	if( my_txn->read_only )
+		Exception::th("Attempt to modify read-only transaction");
 	ass(bucket_desc, "Bucket not valid (using after tx commit?)");
+	if(key.size > max_key_size(my_txn->page_size))
+		Exception::th("Key size too big in Bucket::update");
 	Cursor main_cursor(my_txn, bucket_desc, persistent_name);
-	if( !main_cursor.seek(key) )
-		return false;
-	Val c_key;
-	return main_cursor.get(&c_key, value);
+	const bool same_key = main_cursor.seek(key);
+	Val c_key, c_value;
+	if( same_key )
+		ass(main_cursor.get(&c_key, &c_value), "Cursor get returned false after successfull seek");
+	std::string new_value;
+	const Update result = fn(same_key ? &c_value : nullptr, &new_value);
+	if( result == Update::DEL && same_key )
+		ass(main_cursor.del(), "Cursor del returned false after successfull seek");
+	if( result != Update::PUT )
+		return result;
+	char * dst = put_at(main_cursor, same_key, key, new_value.size());
+	memcpy(dst, new_value.data(), new_value.size());
+	if(DEBUG_MIRROR && bucket_desc != &my_txn->meta_page.meta_bucket){
+	 	my_txn->debug_mirror.at(persistent_name.to_string()).at(key.to_string()).first = new_value;
+		my_txn->check_mirror();
+	}
+	return result;
+}
+static int64_t get_int64(const Val * value, int64_t missing){
+	if( !value )
+		return missing;
+	if( value->size != sizeof(int64_t) )
+		Exception::th("Merge operator requires 8-byte integer value");
+	uint64_t result = 0;
+	unpack_uint_le(value->data, sizeof(int64_t), result);
+	return static_cast<int64_t>(result);
+}
+static Bucket::Update put_int64(int64_t value, std::string * new_value){
+	new_value->resize(sizeof(int64_t));
+	pack_uint_le(&(*new_value)[0], sizeof(int64_t), static_cast<uint64_t>(value));
+	return Bucket::Update::PUT;
+}
+Bucket::UpdateFunction Bucket::add_int64(int64_t delta){
+	return [delta](const Val * value, std::string * new_value){
+		return put_int64(static_cast<int64_t>(static_cast<uint64_t>(get_int64(value, 0)) + static_cast<uint64_t>(delta)), new_value); // wraps around
+	};
+}
+Bucket::UpdateFunction Bucket::max_int64(int64_t val){
+	return [val](const Val * value, std::string * new_value){
+		if( value && get_int64(value, 0) >= val )
+			return Update::KEEP;
+		return put_int64(val, new_value);
+	};
+}
+Bucket::UpdateFunction Bucket::min_int64(int64_t val){
+	return [val](const Val * value, std::string * new_value){
+		if( value && get_int64(value, 0) <= val )
+			return Update::KEEP;
+		return put_int64(val, new_value);
+	};
+}
+Bucket::UpdateFunction Bucket::append(const Val & tail){
+	return [tail = tail.to_string()](const Val * value, std::string * new_value){
+		if( value )
+			new_value->assign(value->data, value->size);
+		*new_value += tail;
+		return Update::PUT;
+	};
+}
+bool Bucket::lookup(const Val & key, Val * value)const{
+	ass(bucket_desc, "Bucket not valid (using after tx commit?)");
+	my_txn->update_reader_slot();
+	Pid pa = bucket_desc->root_page;
+	for(size_t height = bucket_desc->height; height != 0; --height){
+		CNodePtr nap = my_txn->readable_node(pa);
+		pa = nap.get_value(nap.upper_bound_item(key) - 1);
+	}
+	CLeafPtr dap = my_txn->readable_leaf(pa);
+	bool found;
+	int item = dap.lower_bound_item(key, &found);
+	if( !found || !value )
+		return found;
+	Pid overflow_page;
+	auto kv = dap.get_kv(item, overflow_page);
+	if( overflow_page ){
+		Pid overflow_count = (kv.value.size + my_txn->page_size - 1)/my_txn->page_size;
+		kv.value.data = my_txn->readable_overflow(overflow_page, overflow_count);
+	}
+	*value = kv.value;
+	return true;
+}
+bool Bucket::get(const Val & key, Val * value)const{
+	return lookup(key, value);
+}
+bool Bucket::contains(const Val & key)const{
+	return lookup(key, nullptr);
 }
 bool Bucket::del(const Val & key){
 	if( my_txn->read_only )
@@ -133,6 +222,83 @@ bool Bucket::del(const Val & key){
 	ass(main_cursor.del(), "Cursor del returned false after successfull seek");
 	return true;
 }
+size_t Bucket::del_range(const Val & begin, const Val & end){
+	if( my_txn->read_only )
+		Exception::th("Attempt to modify read-only transaction");
+	ass(bucket_desc, "Bucket not valid (using after tx commit?)");
+	ass(bucket_desc != &my_txn->meta_page.meta_bucket, "Meta bucket cannot be modified by del_range");
+	const uint64_t was_item_count = bucket_desc->item_count;
+	Cursor main_cursor(my_txn, bucket_desc, persistent_name);
+	main_cursor.seek(begin);
+	Val c_key, c_value;
+	while( main_cursor.get(&c_key, &c_value) && c_key < end ){
+		// Whole subtrees inside range are unlinked, only items on both edges are deleted one by one
+		const size_t height = main_cursor.get_subtree_height_before(end);
+		if( height == 0 ){
+			ass(main_cursor.del(), "Cursor del returned false after successfull get");
+			continue;
+		}
+		const std::string first_key = DEBUG_MIRROR ? c_key.to_string() : std::string();
+		if(DEBUG_MIRROR)
+			my_txn->before_mirror_operation(bucket_desc, persistent_name);
+		my_txn->erase_subtree(main_cursor, height);
+		if(DEBUG_MIRROR){ // cursor is at first key after subtree, mirror cursors of erased keys were moved there
+			auto & part = my_txn->debug_mirror.at(persistent_name.to_string());
+			const bool has_next = main_cursor.get(&c_key, &c_value);
+			part.erase(part.lower_bound(first_key), has_next ? part.lower_bound(c_key.to_string()) : part.end());
+			my_txn->check_mirror();
+		}
+	}
+	return was_item_count - bucket_desc->item_count;
+}
+void Bucket::truncate(){
+	if( my_txn->read_only )
+		Exception::th("Attempt to modify read-only transaction");
+	ass(bucket_desc, "Bucket not valid (using after tx commit?)");
+	ass(bucket_desc != &my_txn->meta_page.meta_bucket, "Meta bucket cannot be truncated");
+	if(DEBUG_MIRROR){
+		my_txn->before_mirror_operation(bucket_desc, persistent_name);
+		my_txn->debug_mirror.at(persistent_name.to_string()).clear();
+	}
+	my_txn->truncate_bucket(bucket_desc);
+}
+std::vector<Scanner> Bucket::get_scanners(size_t count)const{
+	ass(bucket_desc, "Bucket not valid (using after tx commit?)");
+	if( !my_txn->read_only )
+		Exception::th("Partitioned scan requires read-only transaction");
+	my_txn->update_reader_slot();
+	// Descend level by level until we have enough subtrees, keeping separators between neighbours
+	std::vector<Pid> level{bucket_desc->root_page};
+	std::vector<std::string> separators;
+	for(size_t height = bucket_desc->height; height != 0 && level.size() < count; --height){
+		std::vector<Pid> next_level;
+		std::vector<std::string> next_separators;
+		for(size_t i = 0; i != level.size(); ++i){
+			if( i != 0 )
+				next_separators.push_back(separators.at(i - 1));
+			CNodePtr nap = my_txn->readable_node(level.at(i));
+			next_level.push_back(nap.get_value(-1));
+			for(int item = 0; item != nap.size(); ++item){
+				next_separators.push_back(nap.get_key(item).to_string());
+				next_level.push_back(nap.get_value(item));
+			}
+		}
+		level.swap(next_level);
+		separators.swap(next_separators);
+	}
+	count = std::max<size_t>(1, std::min(count, level.size()));
+	// Scanners prolong slot of shared snapshot from their threads, slot of TX is not thread-safe
+	std::shared_ptr<Snapshot> snapshot = my_txn->snapshot ? my_txn->snapshot : std::shared_ptr<Snapshot>(new Snapshot(*my_txn));
+	std::vector<Scanner> result;
+	std::string begin_key;
+	for(size_t i = 1; i != count; ++i){
+		const std::string & end_key = separators.at(i * level.size() / count - 1);
+		result.push_back(Scanner(snapshot, my_txn->coarse_now, bucket_desc, begin_key, &end_key));
+		begin_key = end_key;
+	}
+	result.push_back(Scanner(snapshot, my_txn->coarse_now, bucket_desc, begin_key, nullptr));
+	return result;
+}
 std::string Bucket::debug_print_db(){
 	return bucket_desc ? my_txn->print_db(bucket_desc) : std::string();
 }
@@ -1,13 +1,18 @@
 #pragma once
 
 #include <string>
+#include <functional>
 #include "pages.hpp"
 #include "cursor.hpp"
+#include "scanner.hpp"
 
 namespace mustela {
 	
 	class Bucket {
 	public:
+		enum class Update { KEEP, PUT, DEL }; // returned by update function, PUT writes new_value
+		typedef std::function<Update(const Val * value, std::string * new_value)> UpdateFunction; // value is nullptr if key does not exist
+
 		Bucket(){}
 		~Bucket();
 		Bucket(Bucket && other);
@@ -22,8 +27,22 @@ namespace mustela {
 				
 		char * put(const Val & key, size_t value_size, bool nooverwrite); // danger! db will alloc space for key/value in db and return address for you to copy value to
 		bool put(const Val & key, const Val & value, bool nooverwrite); // false if nooverwrite and key existed
-		bool get(const Val & key, Val * value)const;
+		bool get(const Val & key, Val * value)const; // does not construct cursor, fastest lookup
+		bool contains(const Val & key)const; // like get, but never touches overflow pages
 		bool del(const Val & key);
+		// Read-modify-write with single descent. Value passed to fn is invalid after update returns
+		Update update(const Val & key, const UpdateFunction & fn);
+		// Merge operators for update, integers are 8-byte little-endian, missing value is 0 for add_int64
+		static UpdateFunction add_int64(int64_t delta);
+		static UpdateFunction max_int64(int64_t value);
+		static UpdateFunction min_int64(int64_t value);
+		static UpdateFunction append(const Val & tail);
+		size_t del_range(const Val & begin, const Val & end); // removes keys in [begin, end), returns number of removed keys
+		void truncate(); // removes all items, cursors are set before first. Pages are freed on commit, like in TX::drop_bucket
+
+		// Splits key range into at most count partitions of roughly equal page count, for scanning from different threads
+		// Requires read-only transaction. Can return less partitions for small buckets
+		std::vector<Scanner> get_scanners(size_t count)const;
 		
 		std::string get_stats()const;
 	//{'branch_pages': 1040L,
@@ -37,6 +56,7 @@ namespace mustela {
 	private:
 		friend class TX;
 		friend class Cursor;
+		friend class WriteBatch;
 		Bucket(TX * my_txn, BucketDesc * bucket_desc, Val name = Val());
 
 		TX * my_txn = nullptr;
@@ -45,6 +65,8 @@ namespace mustela {
 
 		IntrusiveNode<Bucket> tx_buckets;
 		void unlink();
+		bool lookup(const Val & key, Val * value)const; // value can be nullptr
+		char * put_at(Cursor & main_cursor, bool same_key, const Val & key, size_t value_size); // main_cursor is set to key
 	};
 }
 
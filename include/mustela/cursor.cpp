@@ -1,5 +1,6 @@
 #include "mustela.hpp"
 #include <iostream>
+#include <algorithm>
 
 using namespace mustela;
 	
@@ -17,11 +18,13 @@ void Cursor::unlink(){
 	bucket_desc = nullptr;
 	persistent_name = Val{};
 }
-Cursor::Cursor(Cursor && other):my_txn(other.my_txn), bucket_desc(other.bucket_desc), persistent_name(other.persistent_name), path(std::move(other.path)){
+Cursor::Cursor(Cursor && other):my_txn(other.my_txn), bucket_desc(other.bucket_desc), persistent_name(other.persistent_name){
+	copy_path(other);
 	if(my_txn)
     	my_txn->my_cursors.insert_after_this(this, &Cursor::tx_cursors);
 }
-Cursor::Cursor(const Cursor & other):my_txn(other.my_txn), bucket_desc(other.bucket_desc), persistent_name(other.persistent_name), path(other.path){
+Cursor::Cursor(const Cursor & other):my_txn(other.my_txn), bucket_desc(other.bucket_desc), persistent_name(other.persistent_name){
+	copy_path(other);
 	if(my_txn)
     	my_txn->my_cursors.insert_after_this(this, &Cursor::tx_cursors);
 }
@@ -30,7 +33,7 @@ Cursor & Cursor::operator=(Cursor && other){
 	my_txn = other.my_txn;
 	bucket_desc = other.bucket_desc;
 	persistent_name = other.persistent_name;
-	path = std::move(other.path);
+	copy_path(other);
 	if(my_txn)
     	my_txn->my_cursors.insert_after_this(this, &Cursor::tx_cursors);
 	return *this;
@@ -40,11 +43,15 @@ Cursor & Cursor::operator=(const Cursor & other){
 	my_txn = other.my_txn;
 	bucket_desc = other.bucket_desc;
 	persistent_name = other.persistent_name;
-	path = other.path;
+	copy_path(other);
 	if(my_txn)
     	my_txn->my_cursors.insert_after_this(this, &Cursor::tx_cursors);
 	return *this;
 }
+void Cursor::copy_path(const Cursor & other){
+	if( other.bucket_desc )
+		std::copy(other.path.begin(), other.path.begin() + other.bucket_desc->height + 1, path.begin());
+}
 
 bool Cursor::operator==(const Cursor & other)const{
 	if(my_txn != other.my_txn || bucket_desc != other.bucket_desc)
@@ -115,6 +122,28 @@ bool Cursor::fix_cursor_after_last_item(){
 	set_at_direction(height, pa, -1);
 	return true;
 }
+size_t Cursor::get_subtree_height_before(const Val & end){
+	if( at(0).item != 0 )
+		return 0;
+	size_t result = 0;
+	for(size_t height = 1; height <= bucket_desc->height; ++height){
+		bool bounded = false; // child ends before next key in this node or in some parent
+		for(size_t up = height; up <= bucket_desc->height && !bounded; ++up){
+			CNodePtr nap = my_txn->readable_node(at(up).pid);
+			if( at(up).item + 1 == nap.size() )
+				continue;
+			if( end < nap.get_key(at(up).item + 1) )
+				return result;
+			bounded = true;
+		}
+		if( !bounded ) // last child of root is never before end
+			return result;
+		result = height;
+		if( at(height).item != -1 ) // parent node does not start at cursor
+			return result;
+	}
+	return result;
+}
 void Cursor::set_at_direction(size_t height, Pid pa, int dir){
 	while(true){
 		if( height == 0 ){
@@ -61,7 +61,8 @@ namespace mustela {
 			Pid pid = 0;
 			int item = 0;
 		};
-		std::array<Element, MAX_HEIGHT + 1> path{};
+		std::array<Element, MAX_HEIGHT + 1> path{}; // only [0..bucket_desc->height] are used
+		void copy_path(const Cursor & other); // copies only used part
 		Element & at(size_t height){ return path.at(height); }
 		Element at(size_t height)const { return path.at(height); }
 		// All node indices are always [-1..node.size-1]
@@ -70,6 +71,7 @@ namespace mustela {
 		// To speed up Cursor construction, we define another special value for end - path.at(0).first == 0
 		
 		bool fix_cursor_after_last_item(); // true if points to item
+		size_t get_subtree_height_before(const Val & end); // highest node whose child starts at cursor and ends before end, 0 if none
 		void set_at_direction(size_t height, Pid pa, int dir);
 
 		void on_insert(BucketDesc * desc, size_t height, Pid pa, int insert_index, int insert_count = 1){
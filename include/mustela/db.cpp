@@ -4,6 +4,10 @@
 #include <algorithm>
 #include <memory>
 #include <unistd.h> // sleep
+#include <chrono>
+#include <map>
+#include <tuple>
+#include <limits>
 
 using namespace mustela;
 
@@ -11,8 +15,56 @@ std::string DB::lib_version(){
 	return "0.02";
 }
 
-// TODO - detect R/O filesystem
+// Options which change behaviour of shared state are part of the key
+typedef std::tuple<uint64_t, uint64_t, bool, bool, bool, size_t, uint32_t, uint32_t, size_t, size_t> CoreKey;
+
+static CoreKey get_core_key(uint64_t dev, uint64_t ino, const DBOptions & options){
+	return CoreKey(dev, ino, options.read_only, options.data_sync, options.meta_sync, options.minimal_mapping_size, options.reader_timeout_seconds, options.writer_stall_ms, options.drop_pages_per_commit, options.punch_hole_min_size);
+}
+
+struct CoreRegistry {
+	std::mutex mu;
+	std::map<CoreKey, std::weak_ptr<DBCore>> cores;
+};
+
+static CoreRegistry & get_core_registry(){
+	static CoreRegistry registry; // never destroyed before DB objects in other statics
+	return registry;
+}
+
+std::shared_ptr<DBCore> DB::open_core(const std::string & file_path, const DBOptions & options){
+	CoreRegistry & registry = get_core_registry();
+	std::lock_guard<std::mutex> lock(registry.mu);
+	uint64_t dev = 0, ino = 0;
+	if( os::get_file_identity(file_path, &dev, &ino) ){
+		auto it = registry.cores.find(get_core_key(dev, ino, options));
+		if( it != registry.cores.end() ){
+			std::shared_ptr<DBCore> core = it->second.lock();
+			if( core )
+				return core;
+		}
+	}
+	std::shared_ptr<DBCore> core = std::make_shared<DBCore>(file_path, options);
+	core->data_file.get_identity(&dev, &ino); // file could be created or replaced since we checked path
+	for(auto it = registry.cores.begin(); it != registry.cores.end();)
+		if( it->second.expired() )
+			it = registry.cores.erase(it);
+		else
+			++it;
+	registry.cores[get_core_key(dev, ino, options)] = core;
+	return core;
+}
+
 DB::DB(const std::string & file_path, DBOptions options):
+	options(options),
+	core(open_core(file_path, options)),
+	page_size(core->page_size) {
+	if(options.reader_heartbeat)
+		core->start_heartbeat();
+}
+
+// TODO - detect R/O filesystem
+DBCore::DBCore(const std::string & file_path, const DBOptions & options):
 	readonly_fs(os::file_exists_on_readonly_partition(file_path)),
 	options(options),
 	map_granularity(os::get_map_granularity()),
@@ -42,32 +94,57 @@ DB::DB(const std::string & file_path, DBOptions options):
 	if(newest_mp.pid_size != NODE_PID_SIZE)
 		Exception::th("Incompatible pid size");
 }
-DB::~DB(){
-	ass(r_transactions_counter == 0, "Some reader TX still exist while in DB::~DB");
-	ass(!wr_transaction, "Write transaction still in progress while in DB::~DB");
+void DBCore::start_heartbeat(){
+	std::unique_lock<std::mutex> lock(heartbeat_mu);
+	if(heartbeat_thread.joinable())
+		return;
+	coarse_now = ReaderTable::now();
+	heartbeat_thread = std::thread(&DBCore::run_heartbeat, this);
+}
+void DBCore::run_heartbeat(){
+	std::unique_lock<std::mutex> lock(heartbeat_mu);
+	while(!heartbeat_quit){
+		// Several times per second, so readers see new second soon after it starts
+		heartbeat_cond.wait_for(lock, std::chrono::milliseconds(100));
+		coarse_now.store(ReaderTable::now(), std::memory_order_relaxed);
+	}
+}
+DBCore::~DBCore(){
+	if(heartbeat_thread.joinable()){
+		{
+			std::unique_lock<std::mutex> lock(heartbeat_mu);
+			heartbeat_quit = true;
+		}
+		heartbeat_cond.notify_all();
+		heartbeat_thread.join();
+	}
+	ass(r_transactions_counter == 0, "Some reader TX still exist while in DBCore::~DBCore");
+	ass(!wr_transaction, "Write transaction still in progress while in DBCore::~DBCore");
 	while(!c_mappings.empty()) {
-		ass(c_mappings.back().ref_count == 0, "c_mappings ref counts inconsistent in DB::~DB");
-		data_file.munmap(c_mappings.back().addr, c_mappings.back().size);
+		Mapping * ma = c_mappings.back().get();
+		ass(ma->ref_count == (ma == c_mapping ? 1 : 0), "c_mappings ref counts inconsistent in DBCore::~DBCore");
+		if( !ma->unmapped )
+			data_file.munmap(ma->addr, ma->size);
 		c_mappings.pop_back();
 	}
 	while(!wr_mappings.empty()) {
-		data_file.munmap(wr_mappings.back().addr, wr_mappings.back().size);
+		data_file.munmap(wr_mappings.back()->addr, wr_mappings.back()->size);
 		wr_mappings.pop_back();
 	}
 }
-Tid DB::read_meta_page_tid(Pid index)const {
-	ass(!c_mappings.empty() && (index + 1)*page_size <= c_mappings.at(0).size, "readable_page out of range");
+Tid DBCore::read_meta_page_tid(const Mapping * ma, Pid index)const {
+	ass((index + 1)*page_size <= ma->size, "readable_page out of range");
 	if( (index + 1) * page_size > file_size )
 		return 0;
-	const volatile MetaPage * mp = (const volatile MetaPage *)(c_mappings.at(0).addr + page_size * index);
+	const volatile MetaPage * mp = (const volatile MetaPage *)(ma->addr + page_size * index);
 	return mp->tid;
 }
 
-MetaPage DB::read_meta_page(Pid index)const {
-	ass(!c_mappings.empty() && (index + 1)*page_size <= c_mappings.at(0).size, "readable_page out of range");
+MetaPage DBCore::read_meta_page(const Mapping * ma, Pid index)const {
+	ass((index + 1)*page_size <= ma->size, "readable_page out of range");
 	if( (index + 1) * page_size > file_size )
 		return MetaPage{};
-	const volatile MetaPage * mp = (const volatile MetaPage *)(c_mappings.at(0).addr + page_size * index);
+	const volatile MetaPage * mp = (const volatile MetaPage *)(ma->addr + page_size * index);
 	while(true) {
 		MetaPage result;
 		result.tid = mp->tid;
@@ -90,9 +167,9 @@ MetaPage DB::read_meta_page(Pid index)const {
 			return result;
 	}
 }
-void DB::write_meta_page(Pid index, const MetaPage & new_mp){
+void DBCore::write_meta_page(Pid index, const MetaPage & new_mp){
 	ass(!wr_mappings.empty() && (index + 1)*page_size <= file_size, "writable_page out of range");
-	volatile MetaPage * mp = (volatile MetaPage *)(wr_mappings.at(0).addr + page_size * index);
+	volatile MetaPage * mp = (volatile MetaPage *)(wr_mappings.at(0)->addr + page_size * index);
 	mp->magic = new_mp.magic;
 	mp->page_count = new_mp.page_count;
 	mp->meta_bucket.root_page = new_mp.meta_bucket.root_page;
@@ -110,7 +187,7 @@ void DB::write_meta_page(Pid index, const MetaPage & new_mp){
 	mp->tid = new_mp.tid;
 }
 
-bool DB::is_valid_meta(Pid index, const MetaPage & mp)const{
+bool DBCore::is_valid_meta(Pid index, const MetaPage & mp)const{
 	if( mp.pid != index || mp.magic != META_MAGIC)
 		return false; // throw Exception("file is either not mustela DB or corrupted - wrong meta page");
 	if( mp.pid_size < 4 || mp.pid_size > 8 || mp.page_size != page_size || mp.page_count < 4 )
@@ -119,14 +196,14 @@ bool DB::is_valid_meta(Pid index, const MetaPage & mp)const{
 		return false;
 	return true;
 }
-bool DB::is_valid_meta_strict(const MetaPage & mp)const{
+bool DBCore::is_valid_meta_strict(const MetaPage & mp)const{
 	if( mp.meta_bucket.root_page >= mp.page_count )
 		return false;
 	if( mp.version != OUR_VERSION || mp.pid_size != NODE_PID_SIZE )
 		return false;
 	return true;
 }
-void DB::debug_print_meta_page(Pid i, const MetaPage & mp)const{
+void DBCore::debug_print_meta_page(Pid i, const MetaPage & mp)const{
 	std::cerr << "  meta page " << i << ": ";
 	bool eof = (i + 1) * page_size > file_size;
 	bool crc_ok = mp.crc32 == crc32c(0, &mp, sizeof(MetaPage) - sizeof(uint32_t));
@@ -134,13 +211,13 @@ void DB::debug_print_meta_page(Pid i, const MetaPage & mp)const{
 	std::cerr << " pid=" << mp.pid << " tid=" << mp.tid << " page_count=" << mp.page_count << " ver=" << mp.version << " pid_size=" << mp.pid_size << std::endl;;
 	std::cerr << "    meta bucket: height=" << mp.meta_bucket.height << " items=" << mp.meta_bucket.item_count << " leafs=" << mp.meta_bucket.leaf_page_count << " nodes=" << mp.meta_bucket.node_page_count << " overflows=" << mp.meta_bucket.overflow_page_count << " root_page=" << mp.meta_bucket.root_page << " strict=" << is_valid_meta_strict(mp) << std::endl;
 }
-Pid DB::get_worst_meta_page(Tid * earliest_tid)const{
+Pid DBCore::get_worst_meta_page(const Mapping * ma, Tid * earliest_tid)const{
 	MetaPage mpp[META_PAGES_COUNT];
 	bool valid_mpp[META_PAGES_COUNT];
 	Pid worst_pid = META_PAGES_COUNT;
 	Tid worst_tid = 0;
 	for(Pid i = 0; i != META_PAGES_COUNT; ++i){
-		mpp[i] = read_meta_page(i);
+		mpp[i] = read_meta_page(ma, i);
 		valid_mpp[i] = is_valid_meta(i, mpp[i]) && is_valid_meta_strict(mpp[i]);
 		if(valid_mpp[i] && mpp[i].page_count * page_size > file_size)
 			valid_mpp[i] = false; // This fun is called from writer, file size cannot change while write tx is going
@@ -163,15 +240,18 @@ Pid DB::get_worst_meta_page(Tid * earliest_tid)const{
 	return worst_pid;
 }
 
-bool DB::get_newest_meta_page(MetaPage * newest_mp, Tid * earliest_tid, bool strict){
+bool DBCore::get_newest_meta_page(const Mapping * ma, MetaPage * newest_mp, Tid * earliest_tid, bool strict){
 	MetaPage mpp[META_PAGES_COUNT];
 	bool valid_mpp[META_PAGES_COUNT];
 	for(Pid i = 0; i != META_PAGES_COUNT; ++i){
-		mpp[i] = read_meta_page(i);
+		mpp[i] = read_meta_page(ma, i);
 		valid_mpp[i] = is_valid_meta(i, mpp[i]) && (!strict || is_valid_meta_strict(mpp[i]));
-		if(valid_mpp[i] && mpp[i].page_count * page_size > file_size){
-			file_size = data_file.get_size(); // file grew while we were not looking
-			valid_mpp[i] = mpp[i].page_count * page_size <= file_size;
+		uint64_t fs = file_size;
+		if(valid_mpp[i] && mpp[i].page_count * page_size > fs){
+			uint64_t new_fs = data_file.get_size(); // file grew while we were not looking
+			while(fs < new_fs && !file_size.compare_exchange_weak(fs, new_fs)) // other readers could set it concurrently
+				;
+			valid_mpp[i] = mpp[i].page_count * page_size <= new_fs;
 		}
 	}
 	for(Pid i = 0; i != META_PAGES_COUNT; ++i){
@@ -196,85 +276,161 @@ bool DB::get_newest_meta_page(MetaPage * newest_mp, Tid * earliest_tid, bool str
 	return false;
 }
 
-void DB::start_transaction(TX * tx){
-	std::unique_ptr<std::lock_guard<std::mutex>> local_wr_guard;
-	std::unique_ptr<os::FileLock> local_wr_file_lock;
-	if(!tx->read_only){
-		// write TX from same DB wait on guard
-		local_wr_guard = std::make_unique<std::lock_guard<std::mutex>>(wr_mut);
-		// write TX from different DB (same or different process) wait on file lock
-		local_wr_file_lock = std::make_unique<os::FileLock>(data_file);
-//		std::cerr << "Obtained main file write lock " << (size_t)this << std::endl;
-//		sleep(3);
-	}
-	std::unique_lock<std::mutex> lock(mu);
-	ass((!wr_transaction && !wr_file_lock) || tx->read_only, "We can have only one write transaction");
-	ass(!c_mappings.empty(), "c_mappings should not be empty after db is open");
-	{ // Shortest possible lock
-//		os::FileLock reader_table_lock(lock_file);
-//		std::cerr << "Obtained reader table lock " << (size_t)this << std::endl;
-//		sleep(2);
-		ass(get_newest_meta_page(&tx->meta_page, &tx->oldest_reader_tid, true), "No meta found in start_transaction - hot corruption of DB");
-		if(tx->read_only){
-			r_transactions_counter += 1;
-			tx->reader_slot = reader_table.create_reader_slot(tx->meta_page.tid, options.reader_timeout_seconds, lock_file, map_granularity);
-			// Now we read newest meta page again, because it could change while we were grabbing the slot
-			ass(get_newest_meta_page(&tx->meta_page, &tx->oldest_reader_tid, true), "No meta found in start_transaction 2 - hot corruption of DB");
-		} else {
-			wr_transaction = tx;
-			tx->meta_page.tid += 1;
-			tx->meta_page.pid = META_PAGES_COUNT; // So we do not forget to set it before write
-			tx->oldest_reader_tid = reader_table.find_oldest_tid(tx->oldest_reader_tid, lock_file, map_granularity);
-//			tx->oldest_reader_tid = 0;
-			ass(tx->meta_page.tid >= tx->oldest_reader_tid, "We should not be able to treat our own pages as free");
+bool DBCore::get_published_meta_page(const Mapping * ma, MetaPage * newest_mp){
+	if( !reader_table.read_newest_meta(newest_mp) )
+		return false;
+	if( newest_mp->pid >= META_PAGES_COUNT || newest_mp->page_count * page_size > file_size )
+		return false; // file grew while we were not looking, slow path will update file_size
+	// Published meta could be from stale lock file or already overwritten, it is good only if still on disk
+	const volatile MetaPage * mp = (const volatile MetaPage *)(ma->addr + page_size * newest_mp->pid);
+	return mp->tid == newest_mp->tid && mp->crc32 == newest_mp->crc32;
+}
+void DBCore::get_reader_meta_page(const Mapping * ma, MetaPage * newest_mp){
+	if( get_published_meta_page(ma, newest_mp) )
+		return;
+	Tid earliest_tid = 0;
+	ass(get_newest_meta_page(ma, newest_mp, &earliest_tid, true), "No meta found in start_transaction - hot corruption of DB");
+}
+
+Mapping * DBCore::acquire_c_mapping(){
+	while(true){
+		Mapping * ma = c_mapping;
+		ma->ref_count += 1;
+		if( ma == c_mapping ) // If mapping was replaced before we referenced it, it could be already unmapped
+			return ma;
+		release_c_mapping(ma);
+	}
+}
+void DBCore::release_c_mapping(Mapping * ma){
+	if( ma->ref_count.fetch_sub(1) == 1 && !ma->unmapped.exchange(true) )
+		data_file.munmap(ma->addr, ma->size);
+}
+Mapping * DBCore::start_reader(MetaPage * meta_page, ReaderSlotDesc * reader_slot, Pid * file_page_count){
+	Mapping * ma = acquire_c_mapping();
+	get_reader_meta_page(ma, meta_page);
+	r_transactions_counter += 1;
+	Tid slot_tid = meta_page->tid;
+	*reader_slot = reader_table.create_reader_slot(slot_tid, options.reader_timeout_seconds, lock_file, map_granularity);
+	while(true){
+		// Now we read newest meta page again, because it could change while we were grabbing the slot
+		get_reader_meta_page(ma, meta_page);
+		if( meta_page->tid != slot_tid ){ // writer reuses pages between live snapshots, so slot must have exact tid
+			slot_tid = meta_page->tid;
+			if( !reader_table.renew_reader_slot(*reader_slot, slot_tid, options.reader_timeout_seconds) )
+				Exception::th("Timeout in reader transaction - consider increasing read interval in DBOptions");
+			continue;
 		}
-//		std::cerr << "Freeing reader table lock " << (size_t)this << std::endl;
+		uint64_t fs = file_size;
+		if( fs <= ma->size ){
+			*file_page_count = fs / page_size; // whole pages
+			return ma;
+		}
+		release_c_mapping(ma); // file grew beyond our mapping, rare
+		grow_c_mappings_unlocked();
+		ma = acquire_c_mapping();
 	}
-	if(!tx->read_only){
-		file_size = data_file.get_size();
-		grow_wr_mappings(tx->meta_page.page_count, false);
-		wr_guard = std::move(local_wr_guard);
-		wr_file_lock = std::move(local_wr_file_lock);
+}
+void DBCore::finish_reader(Mapping * ma, const ReaderSlotDesc & reader_slot){
+	release_c_mapping(ma);
+	// We release slots without blocking, do not care if will be updated later
+	reader_table.release_reader_slot(reader_slot);
+	r_transactions_counter -= 1;
+	ass(r_transactions_counter >= 0, "read transaction finished twice");
+}
+// If start_transaction throws, other writers should not wait writer_stall_ms for our ticket
+struct WriterTicketGuard {
+	ReaderTable & reader_table;
+	const uint64_t ticket;
+	bool handed_over = false;
+	explicit WriterTicketGuard(ReaderTable & reader_table, uint64_t ticket):reader_table(reader_table), ticket(ticket)
+	{}
+	~WriterTicketGuard(){
+		if( !handed_over )
+			reader_table.release_writer_ticket(ticket);
+	}
+	uint64_t hand_over(){
+		handed_over = true;
+		return ticket;
+	}
+};
+void DBCore::start_transaction(TX * tx){
+	if(tx->read_only){
+		tx->c_mapping = start_reader(&tx->meta_page, &tx->reader_slot, &tx->file_page_count);
+		tx->c_file_ptr = tx->c_mapping->addr;
+		tx->wr_file_ptr = nullptr;
+		return;
+	}
+	const auto wait_start = std::chrono::steady_clock::now();
+	// write TX from same DB wait on guard
+	std::unique_ptr<std::lock_guard<std::mutex>> local_wr_guard = std::make_unique<std::lock_guard<std::mutex>>(wr_mut);
+	// write TX from different DB (same or different process) wait in FIFO queue, then take file lock, usually not contended
+	WriterTicketGuard ticket_guard(reader_table, reader_table.take_writer_ticket(lock_file, map_granularity));
+	const size_t dead_tickets = reader_table.wait_writer_turn(ticket_guard.ticket, data_file, options.writer_stall_ms);
+	std::unique_ptr<os::FileLock> local_wr_file_lock = std::make_unique<os::FileLock>(data_file);
+	ass(!wr_transaction && !wr_file_lock && wr_c_mappings.empty(), "We can have only one write transaction");
+	{
+		const uint64_t wait_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - wait_start).count();
+		std::lock_guard<std::mutex> lock(stats_mu);
+		writer_stats.transactions += 1;
+		writer_stats.wait_total_us += wait_us;
+		writer_stats.wait_max_us = std::max(writer_stats.wait_max_us, wait_us);
+		writer_stats.dead_tickets += dead_tickets;
 	}
-	grow_c_mappings();
-	tx->c_file_ptr = c_mappings.at(0).addr;
-	tx->wr_file_ptr = wr_mappings.empty() ? nullptr : wr_mappings.at(0).addr;
+	wr_c_mappings.push_back(acquire_c_mapping());
+	ass(get_newest_meta_page(wr_c_mappings.back(), &tx->meta_page, &tx->earliest_meta_tid, true), "No meta found in start_transaction - hot corruption of DB");
+	reader_table.publish_newest_meta(tx->meta_page, lock_file, map_granularity); // lock file could be stale or new
+	wr_transaction = tx;
+	tx->meta_page.tid += 1;
+	tx->meta_page.pid = META_PAGES_COUNT; // So we do not forget to set it before write
+	tx->oldest_reader_tid = find_oldest_reader_tid(tx->earliest_meta_tid, &tx->live_reader_tids);
+	ass(tx->meta_page.tid >= tx->oldest_reader_tid, "We should not be able to treat our own pages as free");
+	file_size = data_file.get_size();
+	grow_wr_mappings(tx->meta_page.page_count, false);
+	if( file_size > wr_c_mappings.back()->size ){
+		grow_c_mappings_unlocked();
+		wr_c_mappings.push_back(acquire_c_mapping());
+	}
+	wr_guard = std::move(local_wr_guard);
+	wr_file_lock = std::move(local_wr_file_lock);
+	wr_ticket = ticket_guard.hand_over();
+	tx->c_mapping = nullptr;
+	tx->c_file_ptr = wr_c_mappings.back()->addr;
+	tx->wr_file_ptr = wr_mappings.at(0)->addr;
 	tx->file_page_count = file_size / page_size; // whole pages
-	
-	tx->used_mapping_size = c_mappings.at(0).size;
-	c_mappings.at(0).ref_count += 1;
 }
-void DB::grow_transaction(TX * tx, Pid new_file_page_count){
-	std::unique_lock<std::mutex> lock(mu);
+void DBCore::grow_transaction(TX * tx, Pid new_file_page_count){
 	ass(wr_transaction && tx == wr_transaction && !tx->read_only, "We can only grow write transaction");
-	ass(!c_mappings.empty() && !wr_mappings.empty(), "Mappings should not be empty in grow_transaction");
+	ass(!wr_c_mappings.empty() && !wr_mappings.empty(), "Mappings should not be empty in grow_transaction");
 	grow_wr_mappings(new_file_page_count, true);
-	grow_c_mappings();
-	tx->c_file_ptr = c_mappings.at(0).addr;
-	tx->wr_file_ptr = wr_mappings.at(0).addr;
+	grow_c_mappings_unlocked();
+	wr_c_mappings.push_back(acquire_c_mapping());
+	tx->c_file_ptr = wr_c_mappings.back()->addr;
+	tx->wr_file_ptr = wr_mappings.at(0)->addr;
 	tx->file_page_count = file_size / page_size;
 }
-void DB::commit_transaction(TX * tx, MetaPage meta_page){
-	// TODO - do not take this lock on long operation (msync)
-	std::unique_lock<std::mutex> lock(mu);
+void DBCore::commit_transaction(TX * tx, MetaPage meta_page){
 	ass(tx == wr_transaction, "We can only commit write transaction if it started");
+	// Only writer changes wr_mappings, so we do not need DBCore::mu for msync
 	if(options.data_sync)
-		data_file.msync(wr_mappings.at(0).addr, wr_mappings.at(0).size);
+		data_file.msync(wr_mappings.at(0)->addr, wr_mappings.at(0)->size);
 	__sync_synchronize();
 	
 	Pid oldest_meta_index = 0;
 	{
 //		os::FileLock reader_table_lock(lock_file);
-		Pid worst_pid = get_worst_meta_page(&tx->oldest_reader_tid);
+		Pid worst_pid = get_worst_meta_page(wr_c_mappings.back(), &tx->earliest_meta_tid);
 		meta_page.pid = worst_pid; // We usually save to different slot
 		meta_page.crc32 = crc32c(0, &meta_page, sizeof(MetaPage) - sizeof(uint32_t));
 		ass(is_valid_meta(meta_page.pid, meta_page), "");
 		ass(is_valid_meta_strict(meta_page), "");
 		write_meta_page(worst_pid, meta_page);
+		reader_table.publish_newest_meta(meta_page, lock_file, map_granularity);
+		reader_table.notify_commit();
 		tx->meta_page.tid += 1; // We continue using tx meta_page
 		// We locked reader table anyway, take a chance to update oldest_reader_tid
-		tx->oldest_reader_tid = reader_table.find_oldest_tid(tx->oldest_reader_tid, lock_file, map_granularity);
+		tx->oldest_reader_tid = find_oldest_reader_tid(tx->earliest_meta_tid, &tx->live_reader_tids);
 		ass(tx->meta_page.tid >= tx->oldest_reader_tid, "We should not be able to treat our own pages as free");
+		const uint64_t truncated_size = tx->truncate_on_commit ? get_truncated_file_size() : file_size.load();
 	
 		if(options.data_sync && options.meta_sync){
 			// We can only msync on granularity, find limits
@@ -282,51 +438,244 @@ void DB::commit_transaction(TX * tx, MetaPage meta_page){
 			size_t high = (oldest_meta_index + 1) * page_size;
 			low = ((low / map_granularity)) * map_granularity;
 			high = ((high + map_granularity - 1) / map_granularity) * map_granularity;
-			data_file.msync(wr_mappings.at(0).addr + low, high - low);
+			data_file.msync(wr_mappings.at(0)->addr + low, high - low);
+		}
+		// Readers never touch pages beyond page_count of their meta page
+		// Mappings stay larger than file, which is safe for the same reason
+		if( truncated_size < file_size ){
+			data_file.set_size(truncated_size);
+			file_size = truncated_size;
+			tx->file_page_count = file_size / page_size;
 		}
 	}
 }
-void DB::finish_transaction(TX * tx){
-	// TODO - do not take this lock on long operation (munmap)
-	std::unique_lock<std::mutex> lock(mu);
-	ass(tx->read_only || tx == wr_transaction, "We can only finish write transaction if it started");
-	for(auto && ma : c_mappings)
-		if( (tx->read_only && ma.size == tx->used_mapping_size) ||
-		 	(!tx->read_only && ma.size >= tx->used_mapping_size)) {
-			ma.ref_count -= 1;
-		}
-	tx->c_file_ptr = nullptr;
-	tx->wr_file_ptr = nullptr;
-	tx->file_page_count = 0;
-	tx->used_mapping_size = 0;
-	while(c_mappings.size() > 1 && c_mappings.back().ref_count == 0) {
-		data_file.munmap(c_mappings.back().addr, c_mappings.back().size);
-		c_mappings.pop_back();
+uint32_t DBCore::intern_bucket_name(const std::string & name){
+	std::lock_guard<std::mutex> lock(bucket_cache_mu);
+	auto it = bucket_ids.find(name);
+	if( it != bucket_ids.end() )
+		return it->second;
+	ass(bucket_cache.size() < std::numeric_limits<uint32_t>::max(), "Too many bucket names interned");
+	const uint32_t id = static_cast<uint32_t>(bucket_cache.size());
+	bucket_cache.emplace_back();
+	bucket_cache.back().name = name;
+	bucket_ids.insert(std::make_pair(name, id));
+	return id;
+}
+const std::string & DBCore::get_bucket_name(BucketHandle handle){
+	std::lock_guard<std::mutex> lock(bucket_cache_mu);
+	if( handle.id >= bucket_cache.size() )
+		Exception::th("Invalid bucket handle");
+	return bucket_cache[handle.id].name;
+}
+bool DBCore::get_cached_bucket_desc(const std::string & name, uint32_t * id, Tid tid, BucketDesc * desc){
+	std::lock_guard<std::mutex> lock(bucket_cache_mu);
+	if( *id == std::numeric_limits<uint32_t>::max() ){
+		auto it = bucket_ids.find(name);
+		if( it == bucket_ids.end() )
+			return false;
+		*id = it->second;
+	}
+	const CachedBucketDesc & cached = bucket_cache.at(*id);
+	if( !cached.valid || tid < cached.from_tid || tid > bucket_cache_tid )
+		return false;
+	*desc = cached.desc;
+	return true;
+}
+void DBCore::set_cached_bucket_desc(uint32_t id, Tid tid, const BucketDesc & desc){
+	std::lock_guard<std::mutex> lock(bucket_cache_mu);
+	if( tid < bucket_cache_tid ) // we do not know if desc is still the same
+		return;
+	if( tid > bucket_cache_tid ){ // there were commits we did not see, probably from other process
+		for(auto & cached : bucket_cache)
+			cached.valid = false;
+		bucket_cache_tid = tid;
+	}
+	CachedBucketDesc & cached = bucket_cache.at(id);
+	if( cached.valid )
+		return;
+	cached.valid = true;
+	cached.from_tid = tid;
+	cached.desc = desc;
+}
+void DBCore::commit_bucket_descs(Tid tid, const std::vector<std::pair<const std::string *, const BucketDesc *>> & changed){
+	std::lock_guard<std::mutex> lock(bucket_cache_mu);
+	if( bucket_cache_tid + 1 != tid ) // changes are relative to tid - 1, which we do not know
+		for(auto & cached : bucket_cache)
+			cached.valid = false;
+	for(auto && ch : changed){
+		auto it = bucket_ids.find(*ch.first);
+		if( it == bucket_ids.end() ) // no handle, nothing cached
+			continue;
+		CachedBucketDesc & cached = bucket_cache[it->second];
+		cached.valid = ch.second != nullptr;
+		cached.from_tid = tid;
+		if( ch.second )
+			cached.desc = *ch.second;
+	}
+	bucket_cache_tid = tid;
+}
+uint64_t DBCore::get_truncated_file_size(){
+	Tid earliest_tid = std::numeric_limits<Tid>::max();
+	Pid page_count = 0;
+	for(Pid i = 0; i != META_PAGES_COUNT; ++i){
+		MetaPage mp = read_meta_page(wr_c_mappings.back(), i);
+		if( !is_valid_meta(i, mp) )
+			continue;
+		earliest_tid = std::min(earliest_tid, mp.tid);
+		page_count = std::max(page_count, mp.page_count);
 	}
+	if( reader_table.find_oldest_tid(earliest_tid, lock_file, map_granularity, nullptr) < earliest_tid )
+		return file_size; // some reader uses overwritten meta page, its page_count is unknown
+	return std::min<uint64_t>(file_size, os::grow_to_granularity(page_count * page_size, page_size, map_granularity));
+}
+void DBCore::punch_hole(Pid page, Pid count){
+	if( options.punch_hole_min_size == 0 || count * page_size < options.punch_hole_min_size )
+		return;
+	// Only whole OS pages inside extent, neighbour pages can be in use
+	const uint64_t low = os::grow_to_granularity(page * page_size, map_granularity);
+	const uint64_t high = std::min<uint64_t>((page + count) * page_size, file_size) / map_granularity * map_granularity;
+	if( low >= high || !data_file.punch_hole(low, high - low) )
+		return;
+	for(auto && ma : wr_mappings)
+		if( high <= ma->size )
+			data_file.discard(ma->addr + low, high - low);
+}
+Tid DBCore::refresh_oldest_reader_tid(TX * tx, std::vector<Tid> * live_tids){
+	ass(tx == wr_transaction, "We can only refresh oldest reader for write transaction");
+	MetaPage newest_mp;
+	Tid earliest_tid = 0;
+	ass(get_newest_meta_page(wr_c_mappings.back(), &newest_mp, &earliest_tid, true), "No meta found in refresh_oldest_reader_tid - hot corruption of DB");
+	return find_oldest_reader_tid(earliest_tid, live_tids);
+}
+Tid DBCore::find_oldest_reader_tid(Tid earliest_tid, std::vector<Tid> * live_tids){
+	live_tids->clear();
+	for(Pid i = 0; i != META_PAGES_COUNT; ++i) // invalid meta pages give random tids, which is only conservative
+		live_tids->push_back(read_meta_page_tid(wr_c_mappings.back(), i));
+	Tid oldest_tid = reader_table.find_oldest_tid(earliest_tid, lock_file, map_granularity, live_tids);
+	std::sort(live_tids->begin(), live_tids->end());
+	live_tids->erase(std::unique(live_tids->begin(), live_tids->end()), live_tids->end());
+	return oldest_tid;
+}
+void DBCore::finish_transaction(TX * tx){
 	if(tx->read_only){
-		// We release slots without blocking, do not care if will be updated later
-		reader_table.release_reader_slot(tx->reader_slot);
-		r_transactions_counter -= 1;
-		ass(r_transactions_counter >= 0, "read transaction finished twice");
+		finish_reader(tx->c_mapping, tx->reader_slot);
+		tx->c_mapping = nullptr;
+		tx->c_file_ptr = nullptr;
+		tx->file_page_count = 0;
 		return;
 	}
+	ass(tx == wr_transaction, "We can only finish write transaction if it started");
+	for(auto && ma : wr_c_mappings)
+		release_c_mapping(ma);
+	wr_c_mappings.clear();
+	tx->c_file_ptr = nullptr;
+	tx->wr_file_ptr = nullptr;
+	tx->file_page_count = 0;
 	wr_transaction = nullptr;
 	while(wr_mappings.size() > 1) {
 //		msync(wr_mappings.back().addr, wr_mappings.back().size, MS_SYNC);
-		data_file.munmap(wr_mappings.back().addr, wr_mappings.back().size);
+		data_file.munmap(wr_mappings.back()->addr, wr_mappings.back()->size);
 		wr_mappings.pop_back();
 	}
 //	std::cerr << "Freeing main file write lock " << (size_t)this << std::endl;
 	wr_file_lock.reset();
+	reader_table.release_writer_ticket(wr_ticket);
 	wr_guard.reset();
 //	sleep(1);
 }
+bool DBCore::renew_transaction(TX * tx){
+	ass(tx->read_only && tx->c_mapping, "We can only renew read transaction");
+	MetaPage newest_mp;
+	get_reader_meta_page(tx->c_mapping, &newest_mp);
+	while(true){
+		if( !reader_table.renew_reader_slot(tx->reader_slot, newest_mp.tid, options.reader_timeout_seconds) )
+			return false;
+		// Now we read newest meta page again, because it could change while we were setting the slot
+		get_reader_meta_page(tx->c_mapping, &tx->meta_page);
+		if( tx->meta_page.tid == newest_mp.tid ) // slot must have exact tid, see start_reader
+			break;
+		newest_mp = tx->meta_page;
+	}
+	uint64_t fs = file_size;
+	if( fs > tx->c_mapping->size )
+		return false;
+	tx->file_page_count = fs / page_size;
+	return true;
+}
+Tid DBCore::wait_for_commit(Tid after_tid, uint32_t timeout_ms){
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+	while(true){
+		const uint32_t seq = reader_table.get_commit_seq(lock_file, map_granularity);
+		MetaPage newest_mp;
+		Mapping * ma = acquire_c_mapping();
+		get_reader_meta_page(ma, &newest_mp);
+		release_c_mapping(ma);
+		if( newest_mp.tid > after_tid )
+			return newest_mp.tid;
+		const auto now_time = std::chrono::steady_clock::now();
+		if( now_time >= deadline )
+			return newest_mp.tid;
+		const auto left_ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now_time).count();
+		reader_table.wait_commit_seq(seq, static_cast<uint32_t>(std::max<int64_t>(left_ms, 1)));
+	}
+}
+void DBCore::start_snapshot(Snapshot * snapshot){
+	snapshot->c_mapping = start_reader(&snapshot->meta_page, &snapshot->reader_slot, &snapshot->file_page_count);
+	snapshot->c_file_ptr = snapshot->c_mapping->addr;
+}
+void DBCore::start_snapshot(Snapshot * snapshot, const TX & tx){
+	// Slot of tx protects its tid while we grab our own slot with the same tid
+	tx.c_mapping->ref_count += 1;
+	snapshot->c_mapping = tx.c_mapping;
+	snapshot->c_file_ptr = tx.c_file_ptr;
+	snapshot->file_page_count = tx.file_page_count;
+	snapshot->meta_page = tx.meta_page;
+	r_transactions_counter += 1;
+	snapshot->reader_slot = reader_table.create_reader_slot(tx.meta_page.tid, options.reader_timeout_seconds, lock_file, map_granularity);
+}
+void DBCore::finish_snapshot(Snapshot * snapshot){
+	finish_reader(snapshot->c_mapping, snapshot->reader_slot);
+	snapshot->c_mapping = nullptr;
+	snapshot->c_file_ptr = nullptr;
+	snapshot->file_page_count = 0;
+}
 
-void DB::debug_print_db(){
-	std::cerr << "DB: page_size=" << page_size << " map_granularity=" << map_granularity << " file_size=" << file_size << std::endl;
+void DBCore::debug_print_db(){
+	std::cerr << "DB: page_size=" << page_size << " map_granularity=" << map_granularity << " file_size=" << file_size << " oldest_reader_tid=" << reader_table.get_cached_oldest_tid() << std::endl;
+	Mapping * ma = acquire_c_mapping();
 	for(Pid i = 0; i != META_PAGES_COUNT; ++i){
-		debug_print_meta_page(i, read_meta_page(i));
+		debug_print_meta_page(i, read_meta_page(ma, i));
+	}
+	release_c_mapping(ma);
+}
+void DB::debug_print_db(){
+	core->debug_print_db();
+}
+Tid DB::wait_for_commit(Tid after_tid, uint32_t timeout_ms){
+	return core->wait_for_commit(after_tid, timeout_ms);
+}
+std::shared_ptr<Snapshot> DB::get_current_snapshot(){
+	{
+		std::lock_guard<std::mutex> lock(snapshot_mu);
+		std::shared_ptr<Snapshot> snapshot = current_snapshot.lock();
+		// Slot must not expire before attached TX prolongs it
+		if( snapshot && snapshot->meta_seq % 2 == 0 && snapshot->meta_seq == core->reader_table.get_meta_seq(core->lock_file, core->map_granularity) &&
+			ReaderTable::now() - snapshot->slot_now.load(std::memory_order_relaxed) < options.reader_timeout_seconds / 2 )
+			return snapshot;
 	}
+	std::shared_ptr<Snapshot> snapshot = std::make_shared<Snapshot>(*this); // slow, so outside of lock
+	std::lock_guard<std::mutex> lock(snapshot_mu);
+	current_snapshot = snapshot;
+	return snapshot;
+}
+WriterStats DB::get_writer_stats()const{
+	std::lock_guard<std::mutex> lock(core->stats_mu);
+	return core->writer_stats;
+}
+BucketHandle DB::get_bucket_handle(const Val & name){
+	BucketHandle result;
+	result.id = core->intern_bucket_name(name.to_string());
+	return result;
 }
 size_t DB::max_key_size()const{
     return mustela::max_key_size(page_size);
@@ -340,41 +689,41 @@ void DB::remove_db(const std::string & file_path){
     std::remove((file_path + ".lock").c_str());
 }
 
-bool DB::open_db(MetaPage * newest_mp){
+bool DBCore::open_db(MetaPage * newest_mp){
 //	if( file_size < sizeof(MetaPage) )
 //		throw Exception("File size less than 1 meta page - corrupted by truncation");
 //	os::FileLock reader_table_lock(lock_file); // We read meta pages
 //	file_size = data_file.get_size();
 	page_size = MAX_PAGE_SIZE; // required for grow_c_mappings
-	grow_c_mappings();
-	page_size = read_meta_page(0).page_size;
+	grow_c_mappings_unlocked();
+	const Mapping * ma = c_mapping; // No transactions yet, so no one can replace mapping
+	page_size = read_meta_page(ma, 0).page_size;
 	Tid earliest_tid = 0;
 	if(page_size < MIN_PAGE_SIZE || page_size > MAX_PAGE_SIZE || (page_size & (page_size - 1)) != 0 ||
-		!get_newest_meta_page(newest_mp, &earliest_tid, false)){
+		!get_newest_meta_page(ma, newest_mp, &earliest_tid, false)){
 		// If meta page 0 page_size is corrupted, will have to try all page sizes
 		for(page_size = MIN_PAGE_SIZE; page_size <= MAX_PAGE_SIZE; page_size *= 2)
-			if( get_newest_meta_page(newest_mp, &earliest_tid, false) )
+			if( get_newest_meta_page(ma, newest_mp, &earliest_tid, false) )
 				break;
 		if(page_size > MAX_PAGE_SIZE)
 			return false;
 	}
-	return get_newest_meta_page(newest_mp, &earliest_tid, true);
+	return get_newest_meta_page(ma, newest_mp, &earliest_tid, true);
 }
 
-void DB::create_db(){
+void DBCore::create_db(){
 	// Wrong order is deadlock
 //	os::FileLock reader_table_lock(lock_file); // We modify meta pages
 
 	grow_wr_mappings(META_PAGES_COUNT + 1, false);
-	grow_c_mappings();
 
-//	memset(wr_mappings.at(0).addr, 0, wr_mappings.at(0).size);
+//	memset(wr_mappings.at(0)->addr, 0, wr_mappings.at(0)->size);
 
-	LeafPage * root_page = (LeafPage *)(wr_mappings.at(0).addr + page_size * META_PAGES_COUNT);
+	LeafPage * root_page = (LeafPage *)(wr_mappings.at(0)->addr + page_size * META_PAGES_COUNT);
 	LeafPtr wr_dap(page_size, root_page);
 	wr_dap.init_dirty(0);
 	
-	data_file.msync(wr_mappings.at(0).addr, wr_mappings.at(0).size);
+	data_file.msync(wr_mappings.at(0)->addr, wr_mappings.at(0)->size);
 
 	MetaPage mp{};
 	mp.magic = META_MAGIC;
@@ -388,36 +737,45 @@ void DB::create_db(){
 		mp.crc32 = crc32c(0, &mp, sizeof(MetaPage) - sizeof(uint32_t));
 		write_meta_page(mp.pid, mp);
 	}
-	data_file.msync(wr_mappings.at(0).addr, wr_mappings.at(0).size);
+	data_file.msync(wr_mappings.at(0)->addr, wr_mappings.at(0)->size);
 }
 
-void DB::grow_c_mappings() {
-	if( !c_mappings.empty() && c_mappings.at(0).size >= file_size && c_mappings.at(0).size >= META_PAGES_COUNT * MAX_PAGE_SIZE )
-		return;
+Mapping * DBCore::grow_c_mappings() {
+	Mapping * ma = c_mapping;
+	if( ma && ma->size >= file_size && ma->size >= META_PAGES_COUNT * MAX_PAGE_SIZE )
+		return nullptr;
 	uint64_t fs = file_size;
 	if( !readonly_fs && !options.read_only )
 		fs = std::max<uint64_t>(fs, options.minimal_mapping_size) * 128 / 64; // x1.5
 	fs = std::max<uint64_t>(fs, META_PAGES_COUNT * MAX_PAGE_SIZE); // for initial meta discovery in open_db
 	fs = os::grow_to_granularity(fs, page_size, map_granularity);
 	char * wm = data_file.mmap(0, fs, true, false);
-	c_mappings.insert(c_mappings.begin(), Mapping(fs, wm, wr_transaction ? 1 : 0));
+	c_mappings.push_back(std::make_unique<Mapping>(fs, wm));
+	c_mapping = c_mappings.back().get();
+	return ma;
+}
+void DBCore::grow_c_mappings_unlocked() {
+	Mapping * retired = nullptr;
+	{
+		std::unique_lock<std::mutex> lock(mu);
+		retired = grow_c_mappings();
+	}
+	if( retired ) // munmap outside of lock, if no one uses it
+		release_c_mapping(retired);
 }
-void DB::grow_wr_mappings(Pid new_file_page_count, bool grow_more){
+void DBCore::grow_wr_mappings(Pid new_file_page_count, bool grow_more){
 	uint64_t fs = file_size;
  	fs = std::max<uint64_t>(fs, new_file_page_count * page_size);
 	if( grow_more )
 	 	fs = std::max<uint64_t>(fs, options.minimal_mapping_size) * 77 / 64; // x1.2
 	uint64_t new_fs = os::grow_to_granularity(fs, page_size, map_granularity);
-	if(!wr_mappings.empty() && new_fs == file_size && wr_mappings.at(0).size == new_fs)
-		return;
-	ass(wr_mappings.empty() || wr_mappings.at(0).size < new_fs, "file was shrunk beyond our control - write mapping is now invalid");
-	// TODO - be ready to shrinking of file
 	if(new_fs != file_size){
 		data_file.set_size(new_fs);
 		file_size = data_file.get_size();
 		ass( new_fs == file_size, "file failed to grow in grow_file");
 	}
+	if(!wr_mappings.empty() && wr_mappings.at(0)->size >= new_fs)
+		return; // after vacuum truncated file, mapping can be larger than file
 	char * wm = data_file.mmap(0, new_fs, true, true);
-	wr_mappings.insert(wr_mappings.begin(), Mapping(new_fs, wm, 0));
+	wr_mappings.insert(wr_mappings.begin(), std::make_unique<Mapping>(new_fs, wm));
 }
-
@@ -2,8 +2,13 @@
 
 #include <string>
 #include <vector>
+#include <deque>
+#include <unordered_map>
 #include <memory>
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
 #include "pages.hpp"
 #include "tx.hpp"
 #include "lock.hpp"
@@ -18,51 +23,74 @@ namespace mustela {
 		size_t new_db_page_size = 0; // 0 - select automatically. Used only when creating file
 		size_t minimal_mapping_size = 1024; // Good for test, TODO - set to larger value closer to release
 		uint32_t reader_timeout_seconds = 60; // Reader transaction will throw if nothing is read during this period
+		bool reader_heartbeat = false; // Background thread publishes current time, so readers do not call clock_gettime on every operation
+		bool share_read_snapshots = false; // Read TXs started while there were no commits share one reader slot, reset/renew still work
+		uint32_t writer_stall_ms = 1000; // Writer queue skips ticket of crashed writer after queue does not move for this period
+		// 0 - commit frees all pages of dropped and truncated buckets, otherwise the rest is freed by next commits,
+		// including commits without changes, so after dropping app can commit empty write TXs until done
+		size_t drop_pages_per_commit = 0;
+		size_t punch_hole_min_size = 0; // 0 - never. Free extents of this size and larger are given back to file system, file gets sparse
 	};
 
-	class DB {
-	public:
-		explicit DB(const std::string & file_path, DBOptions options = DBOptions{});
-		~DB();
-		
-		static void remove_db(const std::string & file_path);
+	struct WriterStats { // Since DB file was opened in this process
+		uint64_t transactions = 0;
+		uint64_t wait_total_us = 0; // Time write transactions waited for other writers
+		uint64_t wait_max_us = 0;
+		uint64_t dead_tickets = 0; // Skipped tickets of writers which crashed or are too slow to take file lock
+	};
 
-		static std::string lib_version();
-		size_t max_key_size()const;
-		size_t max_bucket_name_size()const;
-		
-		void debug_print_db();
-	protected:
+	// Mappings cannot be in chunks, because count pages could fall onto the edge between chunks
+	// Readers reference mappings without locking DB::mu, see DB::acquire_c_mapping
+	struct Mapping {
+		const size_t size;
+		char * const addr;
+		std::atomic<int> ref_count{1}; // +1 for being current mapping
+		std::atomic<bool> unmapped{false}; // retired mapping can be unmapped only once
+		explicit Mapping(size_t size, char * addr):size(size), addr(addr)
+		{}
+	};
+
+	// State shared by all DB objects opened for the same file in this process
+	// (mappings, reader table mapping, writer mutex), see DB::open_core
+	class DBCore {
+	public:
+		explicit DBCore(const std::string & file_path, const DBOptions & options);
+		~DBCore();
+	private:
+		friend class DB;
 		friend class TX;
+		friend class Snapshot;
 		void start_transaction(TX * tx);
 		void grow_transaction(TX * tx, Pid new_file_page_count);
 		void commit_transaction(TX * tx, MetaPage meta_page);
+		uint64_t get_truncated_file_size(); // after new meta page is written, file must cover all meta pages readers can use
+		void punch_hole(Pid page, Pid count); // page range must be free for all readers, does nothing if disabled
 		void finish_transaction(TX * tx);
-	private:
+		bool renew_transaction(TX * tx); // false if tx should be restarted
+		Tid refresh_oldest_reader_tid(TX * tx, std::vector<Tid> * live_tids);
+		void start_snapshot(Snapshot * snapshot);
+		void start_snapshot(Snapshot * snapshot, const TX & tx); // tx must hold its reader slot
+		void finish_snapshot(Snapshot * snapshot);
+		Tid wait_for_commit(Tid after_tid, uint32_t timeout_ms);
+
+		void debug_print_db();
 		void debug_print_meta_page(Pid i, const MetaPage & mp)const;
-		// Mappings cannot be in chunks, because count pages could fall onto the edge between chunks
-		struct Mapping {
-			size_t size;
-			char * addr;
-			int ref_count;
-			explicit Mapping(size_t size, char * addr, int ref_count):size(size), addr(addr), ref_count(ref_count)
-			{}
-		};
 		const bool readonly_fs;
 		const DBOptions options;
 		const size_t map_granularity;
 		os::File data_file;
 		os::File lock_file;
 		size_t page_size = 0;
-		uint64_t file_size = 0;
+		std::atomic<uint64_t> file_size{0}; // only grows, except by writer (vacuum truncates file)
 
-		std::mutex mu; // protect vars shared between all transactions
-		TX * wr_transaction = nullptr;
-		int r_transactions_counter = 0;
+		std::mutex mu; // protects growing of c_mappings. Readers take it only when current mapping is too small
+		TX * wr_transaction = nullptr; // protected by wr_mut
+		std::atomic<int> r_transactions_counter{0};
 		// mappings are expensive to create, so they are shared between transactions
-		std::vector<Mapping> c_mappings;
-		// c_mapping.at(0).end >= file_size
-		std::vector<Mapping> wr_mappings;
+		std::vector<std::unique_ptr<Mapping>> c_mappings; // all ever created, we unmap them, but keep objects till ~DBCore
+		std::atomic<Mapping *> c_mapping{nullptr}; // current, c_mapping->size >= file_size
+		std::vector<Mapping *> wr_c_mappings; // references held by write transaction, it can use all of them
+		std::vector<std::unique_ptr<Mapping>> wr_mappings;
 		// empty() || wr_mapping.at(0).end <= file_size
 		// ref_count is not used in wr_mappings
 		
@@ -71,20 +99,92 @@ namespace mustela {
 		std::mutex wr_mut;
 		std::unique_ptr<std::lock_guard<std::mutex>> wr_guard;
 		std::unique_ptr<os::FileLock> wr_file_lock;
+		uint64_t wr_ticket = 0;
+
+		std::mutex stats_mu;
+		WriterStats writer_stats;
+
+		// One heartbeat thread per core, started by first DB object with reader_heartbeat set
+		std::atomic<uint32_t> coarse_now{0}; // published by heartbeat thread, readers prolong slots when it changes
+		std::mutex heartbeat_mu;
+		std::condition_variable heartbeat_cond;
+		bool heartbeat_quit = false;
+		std::thread heartbeat_thread;
+		void start_heartbeat();
+		void run_heartbeat();
+
+		// Bucket descs shared by transactions, index is BucketHandle::id. Entry is valid for tids
+		// [from_tid..bucket_cache_tid], commits of this process move bucket_cache_tid, see TX::load_bucket_desc
+		struct CachedBucketDesc {
+			std::string name; // never changes, so can be read without lock
+			bool valid = false;
+			Tid from_tid = 0;
+			BucketDesc desc{};
+		};
+		std::mutex bucket_cache_mu;
+		std::unordered_map<std::string, uint32_t> bucket_ids;
+		std::deque<CachedBucketDesc> bucket_cache; // deque, so names are not moved
+		Tid bucket_cache_tid = 0;
+		uint32_t intern_bucket_name(const std::string & name);
+		const std::string & get_bucket_name(BucketHandle handle);
+		// only names interned by DB::get_bucket_handle are cached, so by-name lookups do not grow cache
+		bool get_cached_bucket_desc(const std::string & name, uint32_t * id, Tid tid, BucketDesc * desc); // looks up *id by name if it is max
+		void set_cached_bucket_desc(uint32_t id, Tid tid, const BucketDesc & desc); // read from meta bucket of tid
+		void commit_bucket_descs(Tid tid, const std::vector<std::pair<const std::string *, const BucketDesc *>> & changed); // nullptr for dropped
 		
 		bool is_valid_meta(Pid index, const MetaPage & mp)const;
 		bool is_valid_meta_strict(const MetaPage & mp)const;
-		bool get_newest_meta_page(MetaPage * newest_mp, Tid * earliest_tid, bool strict);
-		Pid get_worst_meta_page(Tid * earliest_tid)const;
+		bool get_newest_meta_page(const Mapping * ma, MetaPage * newest_mp, Tid * earliest_tid, bool strict);
+		bool get_published_meta_page(const Mapping * ma, MetaPage * newest_mp); // fast path for readers
+		void get_reader_meta_page(const Mapping * ma, MetaPage * newest_mp);
+		Pid get_worst_meta_page(const Mapping * ma, Tid * earliest_tid)const;
 
-		void grow_c_mappings();
+		Mapping * acquire_c_mapping();
+		void release_c_mapping(Mapping * ma);
+		Mapping * grow_c_mappings(); // under mu, returns previous mapping, caller releases it after unlocking
+		void grow_c_mappings_unlocked();
 		void grow_wr_mappings(Pid new_file_page_count, bool grow_more);
+		Mapping * start_reader(MetaPage * meta_page, ReaderSlotDesc * reader_slot, Pid * file_page_count);
+		void finish_reader(Mapping * ma, const ReaderSlotDesc & reader_slot);
+		// sorted tids of live readers and meta pages (new readers start from them)
+		Tid find_oldest_reader_tid(Tid earliest_tid, std::vector<Tid> * live_tids);
 
-		MetaPage read_meta_page(Pid index)const;
-		Tid read_meta_page_tid(Pid index)const;
+		MetaPage read_meta_page(const Mapping * ma, Pid index)const;
+		Tid read_meta_page_tid(const Mapping * ma, Pid index)const;
 		void write_meta_page(Pid index, const MetaPage & new_mp);
 		void create_db();
 		bool open_db(MetaPage * newest_mp);
 	};
-}
 
+	// Cheap handle, DB objects for the same file and compatible options share one DBCore
+	class DB {
+	public:
+		explicit DB(const std::string & file_path, DBOptions options = DBOptions{});
+		
+		static void remove_db(const std::string & file_path);
+
+		static std::string lib_version();
+		size_t max_key_size()const;
+		size_t max_bucket_name_size()const;
+		// Interned bucket name for TX::get_bucket(BucketHandle), valid for all DB objects of the same file in this process
+		BucketHandle get_bucket_handle(const Val & name);
+		
+		WriterStats get_writer_stats()const;
+		// Blocks until transaction newer than after_tid is committed by any process, returns newest tid
+		// which is <= after_tid on timeout
+		Tid wait_for_commit(Tid after_tid, uint32_t timeout_ms);
+		void debug_print_db();
+	private:
+		friend class TX;
+		friend class Snapshot;
+		const DBOptions options;
+		const std::shared_ptr<DBCore> core;
+		const size_t page_size; // copy from core
+
+		std::mutex snapshot_mu;
+		std::weak_ptr<Snapshot> current_snapshot; // last TX using it releases reader slot
+		std::shared_ptr<Snapshot> get_current_snapshot();
+
+		static std::shared_ptr<DBCore> open_core(const std::string & file_path, const DBOptions & options);
+	};
+}
@@ -14,7 +14,7 @@ namespace mustela {
 	constexpr int MIN_KEY_COUNT = 2;
 	static_assert(MIN_KEY_COUNT == 2, "Should be 2 for invariants, do not change");
 
-	constexpr uint32_t OUR_VERSION = 5;
+	constexpr uint32_t OUR_VERSION = 6; // 6 - 'g' young freelist and 'd' dropped tree records in meta bucket
 
 	constexpr uint64_t META_MAGIC = 0x58616c657473754d; // MustelaX in LE
 	
@@ -36,12 +36,16 @@ namespace mustela {
 	constexpr bool CLEAR_FREE_SPACE = true;
 	constexpr bool DEBUG_PAGES = true;
 	constexpr bool DEBUG_MIRROR = false;
+	constexpr bool DEBUG_FREE_LIST = false; // track pages given in current TX in std::set
 
 // Forward declarations
 	class DB;
+	class DBCore;
 	class TX;
 	class FreeList;
 	class Cursor;
 	class Bucket;
+	class Snapshot;
+	struct Mapping;
 }
 
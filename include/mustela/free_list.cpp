@@ -1,5 +1,6 @@
 #include "mustela.hpp"
 #include <iostream>
+#include <algorithm>
 
 using namespace mustela;
 
@@ -17,13 +18,16 @@ static size_t get_max_record_packed_size(){
 }
 
 void MergablePageCache::clear(){
-	cache.clear();
+	chunks.clear();
 	record_count = 0;
 	page_count = 0;
 	lo_page_count = 0;
 	packed_size = 0;
-	size_index_lo.clear();
-	size_index_hi.clear();
+	bins_lo.clear();
+	bins_hi.clear();
+	stale_count = 0;
+	large_lo.clear();
+	large_hi.clear();
 }
 
 Pid MergablePageCache::get_packed_page_count(size_t page_size)const{
@@ -31,161 +35,299 @@ Pid MergablePageCache::get_packed_page_count(size_t page_size)const{
 	return (packed_size + reduced_size - 1)/reduced_size;
 }
 
-void MergablePageCache::add_to_size_index(Pid page, Pid count, Pid meta_page_count){
-	bool high = page >= meta_page_count*3/4;
-	if(!high)
+size_t MergablePageCache::get_bin(Pid count){
+	if( count < EXACT_BINS )
+		return count;
+	size_t log2 = 0;
+	for(Pid c = count; c > 1; c >>= 1)
+		log2 += 1;
+	return EXACT_BINS + log2 - 6; // 64 is 2^6
+}
+MergablePageCache::Pos MergablePageCache::lower_bound(Pid page)const{
+	auto cit = std::lower_bound(chunks.begin(), chunks.end(), page, [](const std::vector<Extent> & ch, Pid pa){ return ch.back().page < pa; });
+	if( cit == chunks.end() )
+		return Pos{chunks.size(), 0};
+	auto eit = std::lower_bound(cit->begin(), cit->end(), page, [](const Extent & ex, Pid pa){ return ex.page < pa; });
+	return Pos{size_t(cit - chunks.begin()), size_t(eit - cit->begin())};
+}
+MergablePageCache::Pos MergablePageCache::prev(Pos pos)const{
+	ass(!is_begin(pos), "prev of first extent");
+	if( pos.item != 0 )
+		return Pos{pos.chunk, pos.item - 1};
+	return Pos{pos.chunk - 1, chunks[pos.chunk - 1].size() - 1};
+}
+MergablePageCache::Pos MergablePageCache::next(Pos pos)const{
+	if( pos.item + 1 != chunks[pos.chunk].size() )
+		return Pos{pos.chunk, pos.item + 1};
+	return Pos{pos.chunk + 1, 0};
+}
+MergablePageCache::Pos MergablePageCache::erase_extent(Pos pos){
+	auto & ch = chunks[pos.chunk];
+	const Extent & ex = ch[pos.item];
+	record_count -= 1;
+	page_count -= ex.count;
+	packed_size -= get_record_packed_size(ex.page, ex.count);
+	if( update_index ){
+		if( !ex.high )
+			lo_page_count -= ex.count;
+		stale_count += 1;
+		if( ex.count >= EXACT_BINS )
+			erase_large(ex.high ? large_hi : large_lo, std::make_pair(ex.count, ex.page));
+	}
+	ch.erase(ch.begin() + pos.item);
+	if( ch.empty() ){
+		chunks.erase(chunks.begin() + pos.chunk);
+		return Pos{pos.chunk, 0};
+	}
+	if( pos.item == ch.size() )
+		return Pos{pos.chunk + 1, 0};
+	return pos;
+}
+void MergablePageCache::insert_extent(Pos pos, Pid page, Pid count, Pid meta_page_count){
+	Extent ex{page, count, page >= meta_page_count*3/4};
+	record_count += 1;
+	page_count += count;
+	packed_size += get_record_packed_size(page, count);
+	if( chunks.empty() )
+		chunks.emplace_back();
+	if( is_end(pos) )
+		pos = Pos{chunks.size() - 1, chunks.back().size()};
+	auto & ch = chunks[pos.chunk];
+	ch.insert(ch.begin() + pos.item, ex);
+	if( ch.size() > MAX_CHUNK_SIZE ){
+		std::vector<Extent> right(ch.begin() + ch.size()/2, ch.end());
+		ch.resize(ch.size()/2);
+		chunks.insert(chunks.begin() + pos.chunk + 1, std::move(right));
+	}
+	if( !update_index )
+		return;
+	if( !ex.high )
 		lo_page_count += count;
-	auto & size_index = high ? size_index_hi : size_index_lo;
-	auto & sitem = size_index[count];
-	bool ins = sitem.insert(page).second;
-	ass(ins, "Page is twice in size_index");
-}
-bool MergablePageCache::remove_from_size_index(std::map<Pid, std::set<Pid>> &size_index, Pid page, Pid count){
-	auto siit = size_index.find(count);
-	if(siit == size_index.end() || siit->second.erase(page) == 0)
+	if( count >= EXACT_BINS )
+		insert_large(ex.high ? large_hi : large_lo, std::make_pair(count, page));
+	if( stale_count > 2*record_count + 1024 )
+		rebuild_bins();
+	else
+		add_to_bins(ex);
+}
+void MergablePageCache::insert_large(LargeExtents & large, std::pair<Pid, Pid> cp){
+	auto cit = std::lower_bound(large.begin(), large.end(), cp, [](const std::vector<std::pair<Pid, Pid>> & ch, std::pair<Pid, Pid> v){ return ch.back() < v; });
+	if( cit == large.end() ){
+		if( large.empty() )
+			large.emplace_back();
+		cit = large.end() - 1;
+	}
+	cit->insert(std::lower_bound(cit->begin(), cit->end(), cp), cp);
+	if( cit->size() > MAX_CHUNK_SIZE ){
+		std::vector<std::pair<Pid, Pid>> right(cit->begin() + cit->size()/2, cit->end());
+		cit->resize(cit->size()/2);
+		large.insert(cit + 1, std::move(right));
+	}
+}
+void MergablePageCache::erase_large(LargeExtents & large, std::pair<Pid, Pid> cp){
+	auto cit = std::lower_bound(large.begin(), large.end(), cp, [](const std::vector<std::pair<Pid, Pid>> & ch, std::pair<Pid, Pid> v){ return ch.back() < v; });
+	ass(cit != large.end(), "large extent not found");
+	auto it = std::lower_bound(cit->begin(), cit->end(), cp);
+	ass(it != cit->end() && *it == cp, "large extent not found");
+	cit->erase(it);
+	if( cit->empty() )
+		large.erase(cit);
+}
+const std::pair<Pid, Pid> * MergablePageCache::lower_bound_large(const LargeExtents & large, std::pair<Pid, Pid> cp){
+	auto cit = std::lower_bound(large.begin(), large.end(), cp, [](const std::vector<std::pair<Pid, Pid>> & ch, std::pair<Pid, Pid> v){ return ch.back() < v; });
+	if( cit == large.end() )
+		return nullptr;
+	return &*std::lower_bound(cit->begin(), cit->end(), cp);
+}
+void MergablePageCache::add_to_bins(const Extent & ex){
+	auto & bins = ex.high ? bins_hi : bins_lo;
+	size_t bin = get_bin(ex.count);
+	if( bins.size() <= bin )
+		bins.resize(bin + 1);
+	bins[bin].push_back(std::make_pair(ex.page, ex.count));
+	std::push_heap(bins[bin].begin(), bins[bin].end(), std::greater<std::pair<Pid, Pid>>());
+}
+void MergablePageCache::rebuild_bins(){
+	bins_lo.clear();
+	bins_hi.clear();
+	stale_count = 0;
+	for(auto && ch : chunks)
+		for(auto && ex : ch)
+			add_to_bins(ex);
+}
+bool MergablePageCache::is_in_cache(Pid page, Pid count, bool high)const{
+	Pos pos = lower_bound(page);
+	if( is_end(pos) )
 		return false;
-//	ass(siit != size_index.end(), "Size index find count failed");
-//	ass(, "Size index erase page failed");
-	if(siit->second.empty())
-		size_index.erase(siit);
-	return true;
+	const Extent & ex = at(pos);
+	return ex.page == page && ex.count == count && ex.high == high;
 }
-void MergablePageCache::remove_from_size_index(Pid page, Pid count){
-	if(remove_from_size_index(size_index_lo, page, count)){
-		lo_page_count -= count;
-		return;
+Pid MergablePageCache::get_bin_top(Bin & bin, Pid contigous_count, bool high){
+	while( !bin.empty() ){
+		auto top = bin.front();
+		if( is_in_cache(top.first, top.second, high) )
+			return top.second >= contigous_count ? top.first : 0;
+		std::pop_heap(bin.begin(), bin.end(), std::greater<std::pair<Pid, Pid>>());
+		bin.pop_back();
+		if( stale_count != 0 )
+			stale_count -= 1;
 	}
-	ass(remove_from_size_index(size_index_hi, page, count), "Page is neither in lo nor in hi size index");
+	return 0;
 }
 
 void MergablePageCache::add_to_cache(Pid page, Pid count, Pid meta_page_count){
-//	if( count == 255 )
-//		std::cerr << "MergablePageCache::add_to_cache i=" << int(update_index) << " " << page << ":" << count << std::endl;
-	auto it = cache.lower_bound(page);
-	ass(it == cache.end() || it->first != page, "adding existing page to cache");
-	ass(it == cache.end() || it->first >= page + count, "adding overlapping page to cache (to the right)");
-	if(it != cache.end() && it->first == page + count){
-		if( update_index)
-			remove_from_size_index(it->first, it->second);
-		record_count -= 1;
-		page_count -= it->second;
-		packed_size -= get_record_packed_size(it->first, it->second);
-		count += it->second;
-		it = cache.erase(it);
-	}
-	if( it != cache.begin() ){
-		--it;
-		ass(it->first + it->second <= page, "adding overlapping page to cache (to the left)");
-		if( it->first + it->second == page){
-			if( update_index)
-				remove_from_size_index(it->first, it->second);
-			record_count -= 1;
-			page_count -= it->second;
-			packed_size -= get_record_packed_size(it->first, it->second);
-			page = it->first;
-			count += it->second;
-			it = cache.erase(it);
+	Pos pos = lower_bound(page);
+	ass(is_end(pos) || at(pos).page != page, "adding existing page to cache");
+	ass(is_end(pos) || at(pos).page >= page + count, "adding overlapping page to cache (to the right)");
+	if( !is_end(pos) && at(pos).page == page + count){
+		count += at(pos).count;
+		pos = erase_extent(pos);
+	}
+	if( !is_begin(pos) ){
+		Pos left = prev(pos);
+		ass(at(left).page + at(left).count <= page, "adding overlapping page to cache (to the left)");
+		if( at(left).page + at(left).count == page){
+			page = at(left).page;
+			count += at(left).count;
+			pos = erase_extent(left);
 		}
 	}
-	record_count += 1;
-	page_count += count;
-	packed_size += get_record_packed_size(page, count);
-	cache.insert(std::make_pair(page, count));
-	if( update_index)
-		add_to_size_index(page, count, meta_page_count);
+	insert_extent(pos, page, count, meta_page_count);
 }
 
-// TODO - 2 size indexes
 void MergablePageCache::remove_from_cache(Pid page, Pid count, Pid meta_page_count){
-	auto it = cache.find(page);
-	ass(it != cache.end() && it->second >= count, "invalid remove from cache");
-	if( update_index )
-		remove_from_size_index(it->first, it->second);
-	if( count == it->second ){
-		record_count -= 1;
-		page_count -= it->second;
-		packed_size -= get_record_packed_size(it->first, it->second);
-		cache.erase(it);
-		return;
-	}
-	auto old_count = it->second;
-	record_count -= 1;
-	page_count -= it->second;
-	packed_size -= get_record_packed_size(it->first, it->second);
-	cache.erase(it);
-	old_count -= count;
-	page += count;
-	if( update_index)
-		add_to_size_index(page, old_count, meta_page_count);
-	record_count += 1;
-	page_count += old_count;
-	packed_size += get_record_packed_size(page, old_count);
-	cache.insert(std::make_pair(page, old_count));
+	Pos pos = lower_bound(page);
+	ass(!is_end(pos) && at(pos).page == page && at(pos).count >= count, "invalid remove from cache");
+	Pid old_count = at(pos).count;
+	pos = erase_extent(pos);
+	if( count != old_count )
+		insert_extent(pos, page + count, old_count - count, meta_page_count);
 }
 
-static size_t lala_counter = 0;
+Pid MergablePageCache::get_near_free_page(Pid contigous_count, bool high, Pid hint)const{
+	Pid best = 0;
+	Pid best_distance = HINT_DISTANCE + 1;
+	Pos pos = lower_bound(hint);
+	for(Pos right = pos; !is_end(right) && at(right).page - hint < best_distance; ){
+		const Extent & ex = at(right);
+		if( ex.high == high && ex.count >= contigous_count ){
+			best = ex.page;
+			best_distance = ex.page - hint;
+			break;
+		}
+		right = next(right);
+	}
+	for(Pos left = pos; !is_begin(left); ){ // take pages from the end of extents before hint
+		left = prev(left);
+		const Extent & ex = at(left);
+		if( ex.page + ex.count <= hint && hint - (ex.page + ex.count) >= best_distance )
+			break;
+		if( ex.high == high && ex.count >= contigous_count ){
+			Pid pa = std::min(ex.page + ex.count - contigous_count, std::max(ex.page, hint));
+			Pid distance = pa > hint ? pa - hint : hint - pa;
+			if( distance < best_distance )
+				best = pa;
+			break;
+		}
+	}
+	return best;
+}
 
-Pid MergablePageCache::get_free_page(Pid contigous_count, bool high, Pid meta_page_count){
-	auto & size_index = high ? size_index_hi : size_index_lo;
-	auto siit = size_index.lower_bound(contigous_count);
-	if( siit == size_index.end() )
-		return 0;
-	Pid pa = *(siit->second.begin());
-	++siit;
+Pid MergablePageCache::get_free_page(Pid contigous_count, bool high, Pid meta_page_count, Pid hint){
+	if( hint != 0 ){
+		Pid pa = get_near_free_page(contigous_count, high, hint);
+		if( pa != 0 ){
+			remove_range(pa, contigous_count, meta_page_count);
+			ass(pa >= META_PAGES_COUNT, "Meta somehow got into freelist");
+			return pa;
+		}
+	}
+	auto & bins = high ? bins_hi : bins_lo;
+	size_t bin = get_bin(contigous_count);
+	Pid pa = 0;
 	size_t cou = 0;
-	for(;siit != size_index.end(); ++siit){
-		Pid try_pa = *(siit->second.begin());
-		if( try_pa < pa )
+	if( bin >= EXACT_BINS ){ // counts in bin differ, take best fit among them
+		const LargeExtents & large = high ? large_hi : large_lo;
+		const std::pair<Pid, Pid> * it = lower_bound_large(large, std::make_pair(contigous_count, Pid(0)));
+		if( it && get_bin(it->first) == bin ){
+			pa = it->second;
+			cou += 1;
+		}
+		bin += 1;
+	}
+	// like best fit, but prefer lower pages among several next sizes
+	for(; bin < bins.size() && cou < 6; ++bin){
+		Pid try_pa = get_bin_top(bins[bin], contigous_count, high);
+		if( try_pa == 0 )
+			continue;
+		if( pa == 0 || try_pa < pa )
 			pa = try_pa;
 		cou += 1;
-		if( cou > 4)
-			break;
-	}
-	if( contigous_count == 1 && cache.begin()->first < pa )
-		pa = cache.begin()->first;
-	if(cou > lala_counter){
-		lala_counter = cou;
-		std::cout << "lala_counter=" << lala_counter << std::endl;
 	}
+	if( pa == 0 )
+		return 0;
+	if( contigous_count == 1 && chunks.front().front().page < pa )
+		pa = chunks.front().front().page;
 	remove_from_cache(pa, contigous_count, meta_page_count);
 	ass(pa >= META_PAGES_COUNT, "Meta somehow got into freelist");
 	// TODO - check tid of the page?
 	return pa;
 }
 Pid MergablePageCache::defrag_end(Pid meta_page_count){
-	if( cache.empty() )
+	if( chunks.empty() )
 		return 0;
-	auto fit = cache.end();
-	--fit;
-	Pid last_page = fit->first;
-	Pid last_count = fit->second;
+	Pid last_page = chunks.back().back().page;
+	Pid last_count = chunks.back().back().count;
 	ass(last_page + last_count <= meta_page_count, "free list spans last page");
 	if( last_page + last_count != meta_page_count)
 		return 0;
 	remove_from_cache(last_page, last_count, meta_page_count);
 	return last_count;
 }
+Pid MergablePageCache::get_page_count_from(Pid page)const{
+	Pid result = 0;
+	Pos pos = lower_bound(page);
+	if( !is_begin(pos) ){ // extent before can span page
+		const Extent & ex = at(prev(pos));
+		if( ex.page + ex.count > page )
+			result += ex.page + ex.count - page;
+	}
+	for(; !is_end(pos); pos = next(pos))
+		result += at(pos).count;
+	return result;
+}
+Pid MergablePageCache::get_lowest_free_page(Pid contigous_count, Pid limit, Pid meta_page_count){
+	for(auto && ch : chunks)
+		for(auto && ex : ch){
+			if( ex.page + contigous_count > limit )
+				return 0;
+			if( ex.count >= contigous_count ){
+				Pid pa = ex.page;
+				remove_from_cache(pa, contigous_count, meta_page_count);
+				return pa;
+			}
+		}
+	return 0;
+}
 void MergablePageCache::debug_print_db()const{
 	int counter = 0;
 	std::vector<Pid> histogram;
-	Pid last_page = cache.empty() ? 0 : (--cache.end())->first + (--cache.end())->second;
+	Pid last_page = chunks.empty() ? 0 : chunks.back().back().page + chunks.back().back().count;
 	const size_t CHUNK = 10000;
 	histogram.resize((last_page + CHUNK - 1)/CHUNK);
-	for(auto && it : cache){
+	for(auto && ch : chunks)
+	for(auto && it : ch){
 		if( ++counter % 100 == 0)
 			std::cerr << std::endl;
-		std::cerr << "[" << it.first << ":" << it.second << "] ";
+		std::cerr << "[" << it.page << ":" << it.count << "] ";
 		for(size_t hi = 0; hi != histogram.size(); ++hi){
 			Pid start = hi * CHUNK;
 			Pid finish = (hi + 1) * CHUNK;
-//			if(it.first >= finish || it.first + it.second < start)
-//				continue;
-			Pid mi = std::max(it.first, start);
-			Pid ma = std::min(it.first + it.second, finish);
+			Pid mi = std::max(it.page, start);
+			Pid ma = std::min(it.page + it.count, finish);
 			if( ma > mi)
 				histogram[hi] += ma - mi;
 		}
-//		histogram[histogram.size() * it.first / last_page] += it.second;
 	}
 	Pid sum = 0;
 	std::cerr << std::endl;
@@ -196,7 +338,7 @@ void MergablePageCache::debug_print_db()const{
 	std::cerr << "Total free=" << sum << std::endl;
 }
 
-void MergablePageCache::read_packed_page(Val value, Pid meta_page_count){
+void MergablePageCache::read_packed_page(Val value, Pid meta_page_count, std::vector<std::pair<Pid, Pid>> * extents){
 	size_t pos = 0;
 	while(pos + get_max_record_packed_size() <= value.size) {
 		Pid page;
@@ -207,12 +349,46 @@ void MergablePageCache::read_packed_page(Val value, Pid meta_page_count){
 			break;
 		ass(page >= META_PAGES_COUNT, "Meta somehow got into freelist - detected while reading");
 		add_to_cache(page, count, meta_page_count);
+		if( extents )
+			extents->push_back(std::make_pair(page, count));
 	}
 }
 
+bool MergablePageCache::contains(Pid page, Pid count)const{
+	Pos pos = lower_bound(page + 1);
+	if( is_begin(pos) )
+		return false;
+	const Extent & ex = at(prev(pos));
+	return ex.page <= page && page + count <= ex.page + ex.count;
+}
+
+Pid MergablePageCache::get_next_extent(Pid page, Pid * count)const{
+	Pos pos = lower_bound(page + 1);
+	if( !is_begin(pos) && page < at(prev(pos)).page + at(prev(pos)).count )
+		pos = prev(pos);
+	if( is_end(pos) )
+		return 0;
+	*count = at(pos).count;
+	return at(pos).page;
+}
+
+void MergablePageCache::remove_range(Pid page, Pid count, Pid meta_page_count){
+	Pos pos = lower_bound(page + 1);
+	ass(!is_begin(pos), "invalid remove range from cache");
+	pos = prev(pos);
+	const Pid ex_page = at(pos).page;
+	const Pid ex_count = at(pos).count;
+	ass(ex_page <= page && page + count <= ex_page + ex_count, "invalid remove range from cache");
+	pos = erase_extent(pos);
+	if( page + count != ex_page + ex_count )
+		insert_extent(pos, page + count, ex_page + ex_count - page - count, meta_page_count);
+	if( page != ex_page )
+		insert_extent(lower_bound(ex_page), ex_page, page - ex_page, meta_page_count);
+}
+
 void MergablePageCache::fill_packed_pages(TX * tx, Tid tid, const std::vector<MVal> & all_space)const{
 	if(all_space.empty()){
-		ass(cache.empty(), "Empty space for non empty free list");
+		ass(chunks.empty(), "Empty space for non empty free list");
 		return;
 	}
 	// cache may be empty here (all free pages used while puttung all_space into DB), but we must zero-mark all space
@@ -220,9 +396,10 @@ void MergablePageCache::fill_packed_pages(TX * tx, Tid tid, const std::vector<MV
 	ass(space_index < all_space.size(), "No space to save free list, though  enough space was allocated");
 	MVal space = all_space.at(space_index);
 	ass(space.size >= get_max_record_packed_size(), "Must have place for at least 1 record in space item");
-	for(auto && pa : cache){
-		const Pid pid = pa.first;
-		const Pid count = pa.second;
+	for(auto && ch : chunks)
+	for(auto && ex : ch){
+		const Pid pid = ex.page;
+		const Pid count = ex.count;
 		if(space.size < get_max_record_packed_size()){
 			memset(space.data, 0, CLEAR_FREE_SPACE ? space.size : std::min<size_t>(2, space.size));
 			space_index += 1;
@@ -244,14 +421,13 @@ void MergablePageCache::fill_packed_pages(TX * tx, Tid tid, const std::vector<MV
 }
 
 void MergablePageCache::merge_from(const MergablePageCache & other){
-	for(auto && pa : other.cache){
-		Pid pid = pa.first;
-		Pid count = pa.second;
-		add_to_cache(pid, count, 0);
-	}
+	for(auto && ch : other.chunks)
+		for(auto && ex : ch)
+			add_to_cache(ex.page, ex.count, 0);
 }
 
 static const Val freelist_prefix("f", 1);
+static const Val young_freelist_prefix("g", 1);
 
 Val FreeList::fill_free_record_key(char * keybuf, Tid tid, uint64_t batch){
 	memcpy(keybuf, freelist_prefix.data, freelist_prefix.size);
@@ -270,6 +446,46 @@ bool FreeList::parse_free_record_key(Val key, Tid * tid, uint64_t * batch){
 	return p1 == key.size;
 }
 
+Val FreeList::fill_young_record_key(char * keybuf, Tid tid, Tid birth_tid, uint64_t batch){
+	memcpy(keybuf, young_freelist_prefix.data, young_freelist_prefix.size);
+	size_t p1 = young_freelist_prefix.size;
+	p1 += write_u64_sqlite4(tid, keybuf + p1);
+	p1 += write_u64_sqlite4(birth_tid, keybuf + p1);
+	p1 += write_u64_sqlite4(batch, keybuf + p1);
+	return Val(keybuf, p1);
+}
+
+bool FreeList::parse_young_record_key(Val key, Tid * tid, Tid * birth_tid, uint64_t * batch){
+	if(!key.has_prefix(young_freelist_prefix))
+		return false;
+	size_t p1 = young_freelist_prefix.size;
+	p1 += read_u64_sqlite4(*tid, key.data + p1);
+	p1 += read_u64_sqlite4(*birth_tid, key.data + p1);
+	p1 += read_u64_sqlite4(*batch, key.data + p1);
+	return p1 == key.size;
+}
+
+bool FreeList::is_young_record_free(const std::vector<Tid> & live_reader_tids, Tid tid, Tid birth_tid){
+	// Reader with snapshot in [birth_tid, tid) might see some of those pages
+	auto it = std::lower_bound(live_reader_tids.begin(), live_reader_tids.end(), birth_tid);
+	return it == live_reader_tids.end() || *it >= tid;
+}
+
+void FreeList::read_record_value(TX * tx, Val key, Val value){
+	Tid tid = 0;
+	uint64_t batch = 0;
+	const bool ripe = !parse_free_record_key(key, &tid, &batch) || tid != 0;
+	records_to_delete.push_back(ReadRecord{key.to_string(), {}, ripe});
+	read_record_keys.insert(records_to_delete.back().key);
+	free_pages.read_packed_page(value, tx->meta_page.page_count, &records_to_delete.back().extents);
+	if( ripe ) // records of tid 0 were punched when written
+		ripe_extents.insert(ripe_extents.end(), records_to_delete.back().extents.begin(), records_to_delete.back().extents.end());
+	Pid defrag = free_pages.defrag_end(tx->meta_page.page_count);
+	tx->meta_page.page_count -= defrag;
+	if(defrag != 0 && FREE_LIST_VERBOSE_PRINT)
+		std::cerr << "FreeList defrag " << defrag << " pages, now meta.page_count=" << tx->meta_page.page_count << std::endl;
+}
+
 bool FreeList::read_record_space(TX * tx, Tid oldest_read_tid){
 	if( next_record_tid >= oldest_read_tid ) // End of free list reached during last get_free_page
 		return false;
@@ -279,36 +495,93 @@ bool FreeList::read_record_space(TX * tx, Tid oldest_read_tid){
 	{
 		Cursor main_cursor = tx->get_meta_bucket().get_cursor();
 		main_cursor.seek(key);
-		if( !main_cursor.get(&key, &value) || !parse_free_record_key(key, &next_record_tid, &next_record_batch) || next_record_tid >= oldest_read_tid ){
-			next_record_tid = oldest_read_tid; // Fast subsequent checks
-			return false;
+		while( true ){
+			if( !main_cursor.get(&key, &value) || !parse_free_record_key(key, &next_record_tid, &next_record_batch) || next_record_tid >= oldest_read_tid ){
+				next_record_tid = oldest_read_tid; // Fast subsequent checks
+				next_record_batch = 0; // oldest_read_tid can increase, then we continue from the first batch
+				return false;
+			}
+			if( !is_record_read(key) )
+				break;
+			main_cursor.next(); // already read by load_ripe_records
 		}
 	}
 	if(FREE_LIST_VERBOSE_PRINT)
 		std::cerr << "FreeList read " << next_record_tid << ":" << next_record_batch << std::endl;
-	records_to_delete.push_back(std::make_pair(next_record_tid, next_record_batch));
+	read_record_value(tx, key, value);
 	next_record_batch += 1;
-	free_pages.read_packed_page(value, tx->meta_page.page_count);
-	Pid defrag = free_pages.defrag_end(tx->meta_page.page_count);
-	tx->meta_page.page_count -= defrag;
-	if(defrag != 0 && FREE_LIST_VERBOSE_PRINT)
-		std::cerr << "FreeList defrag " << defrag << " pages, now meta.page_count=" << tx->meta_page.page_count << std::endl;
 	return true;
 }
 
+bool FreeList::read_young_record_space(TX * tx){
+	if( young_records_finished )
+		return false;
+	if( next_young_key.empty() )
+		next_young_key = young_freelist_prefix.to_string();
+	Val key, value;
+	Cursor main_cursor = tx->get_meta_bucket().get_cursor();
+	main_cursor.seek(Val(next_young_key));
+	Tid tid, birth_tid;
+	uint64_t batch;
+	for(;main_cursor.get(&key, &value) && parse_young_record_key(key, &tid, &birth_tid, &batch); main_cursor.next() ){
+		if( !is_young_record_free(tx->live_reader_tids, tid, birth_tid) )
+			continue;
+		if( is_record_read(key) )
+			continue; // already read before restart_young_records
+		if(FREE_LIST_VERBOSE_PRINT)
+			std::cerr << "FreeList read young " << tid << ":" << birth_tid << ":" << batch << std::endl;
+		next_young_key = key.to_string() + '\0'; // cursor cannot be kept, meta bucket changes between calls
+		read_record_value(tx, key, value);
+		return true;
+	}
+	young_records_finished = true;
+	return false;
+}
+
+void FreeList::load_ripe_records(TX * tx, Tid oldest_read_tid){
+	char keybuf[32];
+	std::string next_key = fill_free_record_key(keybuf, std::max<Tid>(next_record_tid, 1), 0).to_string();
+	while( true ){
+		Val key, value;
+		Tid tid;
+		uint64_t batch;
+		{
+			Cursor main_cursor = tx->get_meta_bucket().get_cursor();
+			main_cursor.seek(Val(next_key));
+			for(; main_cursor.get(&key, &value) && parse_free_record_key(key, &tid, &batch) && tid < oldest_read_tid; main_cursor.next())
+				if( !is_record_read(key) )
+					break;
+			if( !main_cursor.get(&key, &value) || !parse_free_record_key(key, &tid, &batch) || tid >= oldest_read_tid )
+				break;
+		}
+		if(FREE_LIST_VERBOSE_PRINT)
+			std::cerr << "FreeList read ripe " << tid << ":" << batch << std::endl;
+		next_key = key.to_string() + '\0'; // cursor cannot be kept, meta bucket changes between calls
+		read_record_value(tx, key, value);
+	}
+	while( read_young_record_space(tx) )
+		;
+}
+
+void FreeList::restart_young_records(){
+	next_young_key.clear();
+	young_records_finished = false;
+}
+
 void FreeList::load_all_free_pages(TX * tx, Tid oldest_read_tid){
-	while( read_record_space(tx, oldest_read_tid) )
+	while( read_record_space(tx, oldest_read_tid) || read_young_record_space(tx) )
 		;
 	if(FREE_LIST_VERBOSE_PRINT)
 		std::cerr << "FreeList meta.page_count=" << tx->meta_page.page_count << std::endl;
 }
 
-Pid FreeList::get_free_page(TX * tx, Pid contigous_count, Tid oldest_read_tid, bool updating_meta_bucket){
+Pid FreeList::get_free_page(TX * tx, Pid contigous_count, Tid oldest_read_tid, bool updating_meta_bucket, Pid hint){
 //	load_all_free_pages(tx, oldest_read_tid); // TODO - remove
 	while( true ){
-		Pid pa = free_pages.get_free_page(contigous_count, false, tx->meta_page.page_count);
+		Pid pa = free_pages.get_free_page(contigous_count, false, tx->meta_page.page_count, hint);
 		if( pa != 0){
-			ass(debug_back_from_future_pages.insert(pa).second, "Back from Future double addition");
+			if( DEBUG_FREE_LIST )
+				ass(debug_back_from_future_pages.insert(pa).second, "Back from Future double addition");
 			return pa;
 		}
 		if( updating_meta_bucket) // We want to prevent reading while putting
@@ -316,9 +589,9 @@ Pid FreeList::get_free_page(TX * tx, Pid contigous_count, Tid oldest_read_tid, b
 		for(size_t j = 0; j != page_jump_counter - 1; ++j)
 			if( !read_record_space(tx, oldest_read_tid) )
 				break;
-		if( !read_record_space(tx, oldest_read_tid) ){
-			pa = free_pages.get_free_page(contigous_count, true, tx->meta_page.page_count);
-			if( pa != 0)
+		if( !read_record_space(tx, oldest_read_tid) && !read_young_record_space(tx) ){
+			pa = free_pages.get_free_page(contigous_count, true, tx->meta_page.page_count, hint);
+			if( DEBUG_FREE_LIST && pa != 0)
 				ass(debug_back_from_future_pages.insert(pa).second, "Back from Future double addition");
 			return pa;
 		}else
@@ -326,42 +599,74 @@ Pid FreeList::get_free_page(TX * tx, Pid contigous_count, Tid oldest_read_tid, b
 	}
 }
 
+bool FreeList::has_free_page_below(Pid limit, Pid reserve)const{
+	return free_pages.get_page_count() > reserve && free_pages.get_first_page() < limit;
+}
+
+Pid FreeList::get_free_page_below(Pid contigous_count, Pid limit, Pid meta_page_count){
+	Pid pa = free_pages.get_lowest_free_page(contigous_count, limit, meta_page_count);
+	if( DEBUG_FREE_LIST && pa != 0 )
+		ass(debug_back_from_future_pages.insert(pa).second, "Back from Future double addition");
+	return pa;
+}
+
 void FreeList::get_all_free_pages(TX * tx, MergablePageCache * pages)const{
 	pages->merge_from(free_pages);
+	get_pending_pages(tx, pages);
+}
+
+void FreeList::get_pending_pages(TX * tx, MergablePageCache * pages)const{
 	pages->merge_from(future_pages);
+	pages->merge_from(young_pages);
 
 	char keybuf[32];
 	Val free_key = fill_free_record_key(keybuf, next_record_tid, next_record_batch);
 	Val key, value;
 	Cursor main_cursor = tx->get_meta_bucket().get_cursor();
 	main_cursor.seek(free_key);
-	Tid tid;
+	Tid tid, birth_tid;
 	uint64_t batch;
 	for(;main_cursor.get(&key, &value) && parse_free_record_key(key, &tid, &batch); main_cursor.next() )
 		pages->read_packed_page(value, tx->meta_page.page_count);
+	// young records can be read out of order, so we skip those already in free_pages
+	main_cursor.seek(young_freelist_prefix);
+	for(;main_cursor.get(&key, &value) && parse_young_record_key(key, &tid, &birth_tid, &batch); main_cursor.next() )
+		if( !is_record_read(key) )
+			pages->read_packed_page(value, tx->meta_page.page_count);
 }
 
 void FreeList::add_to_future_from_end_of_file(Pid page){
-	ass(debug_back_from_future_pages.insert(page).second, "Back from Future double addition from end of file");
+	if( DEBUG_FREE_LIST )
+		ass(debug_back_from_future_pages.insert(page).second, "Back from Future double addition from end of file");
 }
 
-void FreeList::mark_free_in_future_page(TX * tx, Pid page, Pid count, bool is_from_current_tid){
+void FreeList::mark_free_in_future_page(TX * tx, Pid page, Pid count, Tid page_tid){
 	ass(page >= META_PAGES_COUNT, "Adding meta to freelist"); // TODO - constant
-	auto bfit = debug_back_from_future_pages.find(page);
-	ass((bfit != debug_back_from_future_pages.end()) == is_from_current_tid, "back from future failed to detect");
-	if( bfit != debug_back_from_future_pages.end()){
-		bfit = debug_back_from_future_pages.erase(bfit);
+	const bool is_from_current_tid = page_tid == tx->tid();
+	if( DEBUG_FREE_LIST ){
+		auto bfit = debug_back_from_future_pages.find(page);
+		ass((bfit != debug_back_from_future_pages.end()) == is_from_current_tid, "back from future failed to detect");
+		if( bfit != debug_back_from_future_pages.end() )
+			debug_back_from_future_pages.erase(bfit);
+	}
+	if( is_from_current_tid ){ // pages we gave in this transaction are returned to us
 		free_pages.add_to_cache(page, count, tx->meta_page.page_count);
 		return;
 	}
+	// If some reader lags behind meta pages, pages born after it will be free as soon as readers in between finish
+	if( tx->oldest_reader_tid < tx->earliest_meta_tid && page_tid > tx->oldest_reader_tid ){
+		young_birth_tid = young_pages.empty() ? page_tid : std::min(young_birth_tid, page_tid);
+		young_pages.add_to_cache(page, count, tx->meta_page.page_count);
+		return;
+	}
 	future_pages.add_to_cache(page, count, tx->meta_page.page_count);
 }
 
-MVal FreeList::grow_record_space(TX * tx, Tid tid, uint32_t & batch){
+MVal FreeList::grow_record_space(TX * tx, Tid tid, Tid birth_tid, uint32_t & batch){
 	Bucket meta_bucket = tx->get_meta_bucket();
 	while(true){ // step over collisions in zero tid batches
 		char keybuf[32];
-		Val key = fill_free_record_key(keybuf, tid, batch);
+		Val key = birth_tid != 0 ? fill_young_record_key(keybuf, tid, birth_tid, batch) : fill_free_record_key(keybuf, tid, batch);
 		batch += 1;
 		char * raw_space = meta_bucket.put(key, tx->page_size, true);
 		if(raw_space){
@@ -380,46 +685,109 @@ void FreeList::ensure_have_several_pages(TX * tx, Tid oldest_read_tid){
 		;
 }
 
-void FreeList::commit_free_pages(TX * tx){
+bool FreeList::is_record_read(Val key)const{
+	return read_record_keys.count(key.to_string()) != 0;
+}
+
+void FreeList::keep_unchanged_records(TX * tx, bool keep_ripe){
+	// Pages of kept records are removed from free_pages, but we leave enough for meta bucket updates during commit
+	const Pid reserve = tx->meta_page.meta_bucket.height + 8;
+	size_t kept = 0;
+	for(size_t i = 0; i != records_to_delete.size(); ++i){
+		auto & rr = records_to_delete[i];
+		Pid count = 0;
+		bool unchanged = true;
+		for(auto && ex : rr.extents){
+			count += ex.second;
+			unchanged = unchanged && free_pages.contains(ex.first, ex.second);
+		}
+		if( !unchanged || (rr.ripe && !keep_ripe) || free_pages.get_lo_page_count() < reserve + count ){
+			if( kept != i )
+				records_to_delete[kept] = std::move(rr);
+			kept += 1;
+			continue;
+		}
+		if(FREE_LIST_VERBOSE_PRINT)
+			std::cerr << "FreeList keep " << rr.key.size() << " byte key" << std::endl;
+		read_record_keys.erase(rr.key);
+		for(auto && ex : rr.extents)
+			free_pages.remove_range(ex.first, ex.second, tx->meta_page.page_count);
+	}
+	records_to_delete.resize(kept);
+}
+
+void FreeList::commit_free_pages(TX * tx, bool punch_holes){
+	if( punch_holes )
+		load_ripe_records(tx, tx->oldest_reader_tid);
+	keep_unchanged_records(tx, !punch_holes); // ripe records are rewritten with tid 0 once, so we punch their pages once
 	Bucket meta_bucket = tx->get_meta_bucket();
 	uint32_t old_batch = 0;
 	std::vector<MVal> old_space;
 	uint32_t future_batch = 0;
 	std::vector<MVal> future_space;
-	while(old_space.size() < free_pages.get_packed_page_count(tx->page_size) || future_space.size() < future_pages.get_packed_page_count(tx->page_size) || !records_to_delete.empty()){
+	uint32_t young_batch = 0;
+	std::vector<MVal> young_space;
+	while(old_space.size() < free_pages.get_packed_page_count(tx->page_size) || future_space.size() < future_pages.get_packed_page_count(tx->page_size) || young_space.size() < young_pages.get_packed_page_count(tx->page_size) || !records_to_delete.empty()){
 		while(!records_to_delete.empty()){
-			char keybuf[32];
-			Val key = fill_free_record_key(keybuf, records_to_delete.back().first, records_to_delete.back().second);
+			const std::string key = records_to_delete.back().key;
 			if(FREE_LIST_VERBOSE_PRINT)
-				std::cerr << "FreeList del " << records_to_delete.back().first << ":" << records_to_delete.back().second << std::endl;
+				std::cerr << "FreeList del " << key.size() << " byte key" << std::endl;
 			records_to_delete.pop_back();
-			ass(meta_bucket.del(key), "Failed to delete free list records after reading");
+			read_record_keys.erase(key);
+			ass(meta_bucket.del(Val(key)), "Failed to delete free list records after reading");
 		}
 		while(old_space.size() < free_pages.get_packed_page_count(tx->page_size))
-			old_space.push_back(grow_record_space(tx, 0, old_batch));
+			old_space.push_back(grow_record_space(tx, 0, 0, old_batch));
 		while(future_space.size() < future_pages.get_packed_page_count(tx->page_size))
-			future_space.push_back(grow_record_space(tx, tx->tid(), future_batch));
+			future_space.push_back(grow_record_space(tx, tx->tid(), 0, future_batch));
+		while(young_space.size() < young_pages.get_packed_page_count(tx->page_size))
+			young_space.push_back(grow_record_space(tx, tx->tid(), young_birth_tid, young_batch));
 	}
 	//        std::cerr << tx.print_db() << std::endl;
 	free_pages.fill_packed_pages(tx, 0, old_space);
 	//        std::cerr << tx.print_db() << std::endl;
 	future_pages.fill_packed_pages(tx, tx->tid(), future_space);
+	young_pages.fill_packed_pages(tx, tx->tid(), young_space);
 	//        std::cerr << tx.print_db() << std::endl;
+	if( punch_holes )
+		punch_ripe_extents(tx);
 	clear();
 }
+void FreeList::punch_ripe_extents(TX * tx){
+	// Whole free extent is punched, even if only part of it became free during this TX
+	// Some pages of ripe extents could be given away during this TX
+	std::sort(ripe_extents.begin(), ripe_extents.end());
+	Pid punched_end = 0;
+	for(auto && ex : ripe_extents){
+		Pid count = 0;
+		for(Pid page = free_pages.get_next_extent(ex.first, &count); page != 0 && page < ex.first + ex.second; page = free_pages.get_next_extent(page + count, &count)){
+			if( page + count <= punched_end )
+				continue; // already punched
+			tx->punch_hole(page, count);
+			punched_end = page + count;
+		}
+	}
+}
 void FreeList::clear(){
 	records_to_delete.clear();
+	read_record_keys.clear();
+	ripe_extents.clear();
 	debug_back_from_future_pages.clear();
 	free_pages.clear();
 	future_pages.clear();
+	young_pages.clear();
+	young_birth_tid = 0;
 	next_record_tid = 0;
 	next_record_batch = 0;
+	restart_young_records();
 	page_jump_counter = 1;
 }
 
 void FreeList::debug_print_db(){
 	std::cerr << "FreeList future pages:";
 	future_pages.debug_print_db();
+	std::cerr << "FreeList young pages:";
+	young_pages.debug_print_db();
 	std::cerr << "FreeList free pages:";
 	free_pages.debug_print_db();
 }
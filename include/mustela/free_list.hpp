@@ -4,17 +4,19 @@
 #include <vector>
 #include <map>
 #include <set>
+#include <unordered_set>
 #include "pages.hpp"
 
 namespace mustela {
 
-	// TODO - get rid of std::map and use simpler tree impl
+	// Free extents in chunked sorted vector, plus size bins of lazy min-heaps by page for allocation
+	// Heap entries are not removed when extent changes, they are checked against extents when on top
 	class MergablePageCache {
 	public:
 		explicit MergablePageCache(bool update_index):update_index(update_index)
 		{}
 		void clear();
-		bool empty()const { return cache.empty() && record_count == 0; }
+		bool empty()const { return chunks.empty(); }
 		size_t get_page_count()const { return page_count; }
 		size_t get_lo_page_count()const { return lo_page_count; }
 		size_t get_packed_size()const { return packed_size; }
@@ -24,44 +26,90 @@ namespace mustela {
 		void add_to_cache(Pid page, Pid count, Pid meta_page_count);
 		void remove_from_cache(Pid page, Pid count, Pid meta_page_count);
 
-		Pid get_free_page(Pid contigous_count, bool high, Pid meta_page_count);
+		Pid get_free_page(Pid contigous_count, bool high, Pid meta_page_count, Pid hint = 0); // near hint page if possible
 		Pid defrag_end(Pid meta_page_count);
+		Pid get_lowest_free_page(Pid contigous_count, Pid limit, Pid meta_page_count); // lowest fitting below limit, 0 if none
+		Pid get_first_page()const { return chunks.empty() ? 0 : chunks.front().front().page; }
+		Pid get_page_count_from(Pid page)const; // pages >= page
 		
 		void merge_from(const MergablePageCache & other);
 		
 		void fill_packed_pages(TX * tx, Tid tid, const std::vector<MVal> & space)const;
-		void read_packed_page(Val value, Pid meta_page_count);
+		void read_packed_page(Val value, Pid meta_page_count, std::vector<std::pair<Pid, Pid>> * extents = nullptr);
+		bool contains(Pid page, Pid count)const; // all pages are inside single extent
+		Pid get_next_extent(Pid page, Pid * count)const; // first page of first extent ending after page, 0 if none
+		void remove_range(Pid page, Pid count, Pid meta_page_count); // from the middle of extent
 
 		void debug_print_db()const;
 	private:
 		const bool update_index;
 
-		std::map<Pid, Pid> cache;
+		struct Extent {
+			Pid page;
+			Pid count;
+			bool high; // page was in last quarter of file when indexed
+		};
+		struct Pos {
+			size_t chunk;
+			size_t item;
+		};
+		static constexpr size_t MAX_CHUNK_SIZE = 512; // split in half when exceeded
+		static constexpr Pid HINT_DISTANCE = 64; // free page farther from hint is not considered near
+		std::vector<std::vector<Extent>> chunks; // sorted by page, no empty chunks
 		size_t page_count = 0;
 		size_t lo_page_count = 0;
 		size_t record_count = 0;
 		size_t packed_size = 0;
-		std::map<Pid, std::set<Pid>> size_index_lo;
-		std::map<Pid, std::set<Pid>> size_index_hi;
 
-		void add_to_size_index(Pid page, Pid count, Pid meta_page_count);
-		bool remove_from_size_index(std::map<Pid, std::set<Pid>> &size_index, Pid page, Pid count);
-		void remove_from_size_index(Pid page, Pid count);
+		static constexpr size_t EXACT_BINS = 64; // counts below have own bins, then 1 bin per power of 2
+		typedef std::vector<std::pair<Pid, Pid>> Bin; // min-heap of (page, count)
+		std::vector<Bin> bins_lo;
+		std::vector<Bin> bins_hi;
+		size_t stale_count = 0; // heap entries of removed extents, we rebuild bins when too many
+		// (count, page) of extents with count >= EXACT_BINS, kept exact, for best fit inside first non-exact bin
+		// chunked sorted vector like chunks, so adding and merging extents does not allocate nodes
+		typedef std::vector<std::vector<std::pair<Pid, Pid>>> LargeExtents;
+		LargeExtents large_lo;
+		LargeExtents large_hi;
+		static void insert_large(LargeExtents & large, std::pair<Pid, Pid> cp);
+		static void erase_large(LargeExtents & large, std::pair<Pid, Pid> cp);
+		static const std::pair<Pid, Pid> * lower_bound_large(const LargeExtents & large, std::pair<Pid, Pid> cp); // nullptr if none
+
+		static size_t get_bin(Pid count);
+		Pos lower_bound(Pid page)const; // first extent with extent.page >= page
+		bool is_end(Pos pos)const { return pos.chunk == chunks.size(); }
+		const Extent & at(Pos pos)const { return chunks[pos.chunk][pos.item]; }
+		Pos prev(Pos pos)const;
+		Pos next(Pos pos)const;
+		bool is_begin(Pos pos)const { return pos.chunk == 0 && pos.item == 0; }
+		Pos erase_extent(Pos pos); // returns position of next extent, updates counters
+		void insert_extent(Pos pos, Pid page, Pid count, Pid meta_page_count); // updates counters and bins
+		void add_to_bins(const Extent & ex);
+		bool is_in_cache(Pid page, Pid count, bool high)const;
+		Pid get_bin_top(Bin & bin, Pid contigous_count, bool high); // 0 if no extent fits
+		Pid get_near_free_page(Pid contigous_count, bool high, Pid hint)const; // 0 if no extent near
+		void rebuild_bins();
 	};
 	
 	class FreeList {
 	public:
-		FreeList():free_pages(true), future_pages(false)
+		FreeList():free_pages(true), future_pages(false), young_pages(false)
 		{}
-		Pid get_free_page(TX * tx, Pid contigous_count, Tid oldest_read_tid, bool updating_meta_bucket);
-		void mark_free_in_future_page(TX * tx, Pid page, Pid count, bool is_from_current_tid);
-		void commit_free_pages(TX * tx);
+		Pid get_free_page(TX * tx, Pid contigous_count, Tid oldest_read_tid, bool updating_meta_bucket, Pid hint = 0);
+		void mark_free_in_future_page(TX * tx, Pid page, Pid count, Tid page_tid);
+		void commit_free_pages(TX * tx, bool punch_holes); // see DBOptions::punch_hole_min_size
 		void clear();
+		void restart_young_records(); // after live reader tids change
 		void ensure_have_several_pages(TX * tx, Tid oldest_read_tid); // Called before updates to meta bucket
+		// For vacuum, all free pages must be loaded
+		Pid get_free_page_count()const { return free_pages.get_page_count(); }
+		bool has_free_page_below(Pid limit, Pid reserve)const; // reserve - pages left for path copying
+		Pid get_free_page_below(Pid contigous_count, Pid limit, Pid meta_page_count);
 		
 		void add_to_future_from_end_of_file(Pid page); // remove after testing new method of back to future
 
 		void get_all_free_pages(TX * tx, MergablePageCache * pages)const;
+		void get_pending_pages(TX * tx, MergablePageCache * pages)const; // freed, but not available to us yet
 		void load_all_free_pages(TX * tx, Tid oldest_read_tid);
 		
 		void debug_print_db();
@@ -69,23 +117,45 @@ namespace mustela {
 
 		static Val fill_free_record_key(char * keybuf, Tid tid, uint64_t batch);
 		static bool parse_free_record_key(Val key, Tid * tid, uint64_t * batch);
+		// Young records keep pages born after oldest reader, keyed by tid they were freed and min tid they were born
+		static Val fill_young_record_key(char * keybuf, Tid tid, Tid birth_tid, uint64_t batch);
+		static bool parse_young_record_key(Val key, Tid * tid, Tid * birth_tid, uint64_t * batch);
+		static bool is_young_record_free(const std::vector<Tid> & live_reader_tids, Tid tid, Tid birth_tid);
 	private:
 		MergablePageCache free_pages;
 		MergablePageCache future_pages;
+		MergablePageCache young_pages; // subset of future pages, invisible to old readers
+		Tid young_birth_tid = 0;
 
-		std::set<Pid> debug_back_from_future_pages; // If pages we gave are returned to us, we return them into free_pages instead of future_pages
+		std::set<Pid> debug_back_from_future_pages; // Only if DEBUG_FREE_LIST, pages we gave or got from end of file, they are returned into free_pages
 		
 		size_t page_jump_counter = 1;
 		Tid next_record_tid = 0;
 		uint64_t next_record_batch = 0;
-		std::vector<std::pair<Tid, uint64_t>> records_to_delete;
+		std::string next_young_key;
+		bool young_records_finished = false;
+		struct ReadRecord {
+			std::string key;
+			std::vector<std::pair<Pid, Pid>> extents;
+			bool ripe; // record of freeing tid or young record, not tid 0
+		};
+		std::vector<ReadRecord> records_to_delete;
+		std::unordered_set<std::string> read_record_keys; // keys of records_to_delete, for is_record_read
+		std::vector<std::pair<Pid, Pid>> ripe_extents; // from records of freeing tids, are written with tid 0 on commit
 		// records_to_delete are necessary for now - we are writting [0:0] [0:2] entries
 		// while there could be entries like [0:1] [10:0], we will delete [0:1] next iteration
 		// We cannot modify logic to never read free entries during commit, because we might need lots of free pages
+		// Records with all pages still free are kept as is on commit, so we write only changed records
 		
+		bool is_record_read(Val key)const;
+		void keep_unchanged_records(TX * tx, bool keep_ripe);
+		void load_ripe_records(TX * tx, Tid oldest_read_tid); // so all pages of freeing tids get into tid 0 records
+		void punch_ripe_extents(TX * tx);
 		bool read_record_space(TX * tx, Tid oldest_read_tid);
+		bool read_young_record_space(TX * tx);
+		void read_record_value(TX * tx, Val key, Val value);
 		void fill_record_space(TX * tx, Tid tid, std::vector<MVal> & space, const std::map<Pid, Pid> & pages);
-		MVal grow_record_space(TX * tx, Tid tid, uint32_t & batch);
+		MVal grow_record_space(TX * tx, Tid tid, Tid birth_tid, uint32_t & batch); // young record if birth_tid != 0
 	};
 }
 
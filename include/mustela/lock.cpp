@@ -2,6 +2,8 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include <chrono>
+#include <limits>
+#include <algorithm>
 
 using namespace mustela;
 
@@ -31,116 +33,317 @@ void unpack_rid(uint64_t ridead, uint64_t * reader_id, uint32_t * deadline){
 	*deadline = static_cast<uint32_t>(ridead);
 }
 
-ReaderTable::ReaderTable():random(now())
+// Thread keeps grabbing the same slot, so its cache line is not bounced between cores,
+// and takes reader ids in blocks, so header is not touched on every transaction
+static const uint64_t RID_BLOCK = 64;
+
+struct StickySlot {
+	uint64_t instance_id = 0;
+	size_t slot = std::numeric_limits<size_t>::max();
+	uint64_t next_rid = 0;
+	uint64_t end_rid = 0;
+};
+static thread_local StickySlot sticky_slot;
+
+static std::atomic<uint64_t> instance_counter{0};
+
+static size_t occupancy_bit(size_t slot){
+	return std::min(slot / READER_BLOCK_SLOTS, OCCUPANCY_BITS - 1);
+}
+
+static bool grab_slot(volatile LockFileHeader * header, volatile ReaderSlot * slot, size_t s, uint64_t ridead, uint32_t now, Tid tid){
+	uint64_t other_ridead = slot->ridead;
+	uint64_t other_rid;
+	uint32_t other_deadline;
+	unpack_rid(other_ridead, &other_rid, &other_deadline);
+	if( other_deadline >= now ) // empty slot has 0 deadline
+		return false;
+	if( !__sync_bool_compare_and_swap(&slot->ridead, other_ridead, ridead) )
+		return false;
+	// If we are preempted here and resumed after half an hour, we might write our now very old tid over other reader newer tid
+	slot->tid = tid;
+	// This will not corrupt DB, just prevent reclamation of some pages until that slot is freed or slot deadline passes
+	const size_t bit = occupancy_bit(s);
+	const uint64_t mask = uint64_t(1) << (bit % 64);
+	if( (header->occupied[bit / 64] & mask) == 0 ) // Writer clears bit before scanning block, so if it is set, we will be seen
+		__sync_fetch_and_or(&header->occupied[bit / 64], mask);
+	return true;
+}
+
+ReaderTable::ReaderTable():instance_id(++instance_counter)
 {}
 
 ReaderTable::~ReaderTable()
 {
-	free_mapping();
+	free_mappings();
 }
 
 ReaderSlotDesc ReaderTable::create_reader_slot(Tid tid, uint32_t reader_timeout_seconds, os::File & lock_file, size_t granularity)
 {
-	if(!slots)
-		grow_reader_table(lock_file, granularity, false);
+	static thread_local Random random(now() + reinterpret_cast<uintptr_t>(&random));
+	const TableMapping * ma = mapping.load();
+	if(!ma)
+		ma = grow_reader_table(lock_file, granularity, nullptr);
+	StickySlot & sticky = sticky_slot;
+	if( sticky.instance_id != instance_id ){
+		sticky = StickySlot{};
+		sticky.instance_id = instance_id;
+	}
+	if( sticky.next_rid == sticky.end_rid ){
+		sticky.next_rid = __sync_fetch_and_add(&ma->header->next_reader, RID_BLOCK);
+		sticky.end_rid = sticky.next_rid + RID_BLOCK;
+	}
 	ReaderSlotDesc result;
-	result.rid = __sync_fetch_and_add(&header->next_reader, 1);
+	result.rid = sticky.next_rid++;
 	result.now = now();
 	result.deadline = result.now + reader_timeout_seconds;
 	uint64_t ridead = pack_rid(result.rid, result.deadline);
+	// Fast path - slot we used last time is usually free
+	if( sticky.slot < ma->slots_count && grab_slot(ma->header, &ma->slots[sticky.slot], sticky.slot, ridead, result.now, tid) ){
+		result.slot = sticky.slot;
+		return result;
+	}
 	while(true){
+		const size_t slots_count = ma->slots_count;
 		for(size_t i = 0; i != 2 * slots_count; ++i){ // first pass random, second one - full scan
 			size_t shift = static_cast<size_t>(random.rnd());
 			size_t s = (i >= slots_count) ? (i - slots_count) : (i + shift) % slots_count;
-			uint64_t other_ridead = slots[s].ridead;
-			uint64_t other_rid;
-			uint32_t other_deadline;
-			unpack_rid(other_ridead, &other_rid, &other_deadline);
-			if( other_deadline < result.now ){ // also covers empty slot
-				if( __sync_bool_compare_and_swap(&slots[s].ridead, other_ridead, ridead) ){ // grabbed slot
-					// If we are preempted here and resumed after half an hour, we might write our now very old tid over other reader newer tid
-					slots[s].tid = tid;
-					// This will not corrupt DB, just prevent reclamation of some pages until that slot is freed or slot deadline passes
-					result.slot = s;
-	//				std::cerr << "Grabbed slot=" << i << " tid=" << slots[i].tid << " rand=" << result.rand0 << result.rand1 << std::endl;
-					return result;
-				}
+			if( grab_slot(ma->header, &ma->slots[s], s, ridead, result.now, tid) ){
+				result.slot = s;
+				sticky.slot = s;
+//				std::cerr << "Grabbed slot=" << i << " tid=" << slots[i].tid << " rand=" << result.rand0 << result.rand1 << std::endl;
+				return result;
 			}
 		}
-		grow_reader_table(lock_file, granularity, true);
+		ma = grow_reader_table(lock_file, granularity, ma);
 	}
 }
 
 bool ReaderTable::update_reader_slot(ReaderSlotDesc & slot, uint32_t now, uint32_t reader_timeout_seconds)
 {
-	if( slot.slot >= slots_count )
+	const TableMapping * ma = mapping.load();
+	if( !ma || slot.slot >= ma->slots_count )
 		return false; // logic error
 	uint64_t ridead = pack_rid(slot.rid, slot.deadline);
 	uint32_t new_deadline = now + reader_timeout_seconds;
 	uint64_t next_ridead = pack_rid(slot.rid, new_deadline);
-	if( !__sync_bool_compare_and_swap(&slots[slot.slot].ridead, ridead, next_ridead))
+	if( !__sync_bool_compare_and_swap(&ma->slots[slot.slot].ridead, ridead, next_ridead))
 		return false;
 	slot.now = now;
 	slot.deadline = new_deadline;
 	return true;
 }
 
+bool ReaderTable::renew_reader_slot(ReaderSlotDesc & slot, Tid tid, uint32_t reader_timeout_seconds)
+{
+	// We first prolong slot, so no one can grab it while we are setting tid
+	if( !update_reader_slot(slot, now(), reader_timeout_seconds) )
+		return false;
+	mapping.load()->slots[slot.slot].tid = tid;
+	return true;
+}
+
 void ReaderTable::release_reader_slot(const ReaderSlotDesc & slot){
-	if( slot.slot >= slots_count )
+	const TableMapping * ma = mapping.load();
+	if( !ma || slot.slot >= ma->slots_count )
 		return;
 	uint64_t ridead = pack_rid(slot.rid, slot.deadline);
-	__sync_bool_compare_and_swap(&slots[slot.slot].ridead, ridead, 0);
+	__sync_bool_compare_and_swap(&ma->slots[slot.slot].ridead, ridead, 0);
 }
 
-Tid ReaderTable::find_oldest_tid(Tid writer_tid, os::File & lock_file, size_t granularity)
+Tid ReaderTable::find_oldest_tid(Tid writer_tid, os::File & lock_file, size_t granularity, std::vector<Tid> * live_tids)
 {
-	grow_reader_table(lock_file, granularity, false);
+	const TableMapping * ma = grow_reader_table(lock_file, granularity, nullptr);
+	volatile ReaderSlot * slots = ma->slots;
+	volatile uint64_t * occupied = ma->header->occupied;
 	const auto now_time = now();
-	for(size_t i = 0; i != slots_count; ++i) {
-		uint64_t other_ridead = (const volatile uint64_t &)(slots[i].ridead);
-		uint64_t other_rid;
-		uint32_t other_deadline;
-		unpack_rid(other_ridead, &other_rid, &other_deadline);
-		if( other_deadline >= now_time ){
-			Tid tid = (const volatile Tid &)(slots[i].tid);
-			writer_tid = std::min(writer_tid, tid);
-		}else if(other_ridead != 0){
-			if( !__sync_bool_compare_and_swap(&slots[i].ridead, other_ridead, 0) ){
-				i -= 1; // failed to release slot, need to check it again
-				continue;
+	const size_t last_bit = occupancy_bit(ma->slots_count == 0 ? 0 : ma->slots_count - 1);
+	for(size_t w = 0; w <= last_bit / 64; ++w) {
+		uint64_t word = occupied[w];
+		while(word != 0){
+			const size_t bit = w * 64 + __builtin_ctzll(word);
+			const uint64_t mask = word & (~word + 1);
+			word &= word - 1;
+			__sync_fetch_and_and(&occupied[w], ~mask);
+			const size_t end = bit == OCCUPANCY_BITS - 1 ? ma->slots_count : std::min(ma->slots_count, (bit + 1) * READER_BLOCK_SLOTS);
+			bool live = false;
+			for(size_t i = bit * READER_BLOCK_SLOTS; i < end; ++i) {
+				uint64_t other_ridead = (const volatile uint64_t &)(slots[i].ridead);
+				uint64_t other_rid;
+				uint32_t other_deadline;
+				unpack_rid(other_ridead, &other_rid, &other_deadline);
+				if( other_deadline >= now_time ){
+					Tid tid = (const volatile Tid &)(slots[i].tid);
+					writer_tid = std::min(writer_tid, tid);
+					if( live_tids )
+						live_tids->push_back(tid);
+					live = true;
+				}else if(other_ridead != 0){
+					if( !__sync_bool_compare_and_swap(&slots[i].ridead, other_ridead, 0) ){
+						i -= 1; // failed to release slot, need to check it again
+						continue;
+					}
+				}
 			}
+			if( live )
+				__sync_fetch_and_or(&occupied[w], mask);
 		}
 	}
+	ma->header->oldest_tid = writer_tid;
 	return writer_tid;
 }
 
-void ReaderTable::free_mapping(){
-	if(mapping){
-		munmap(mapping, mapping_size);
-		mapping = nullptr;
-		mapping_size = 0;
-		slots = nullptr;
-		slots_count = 0;
-		header = nullptr;
+Tid ReaderTable::get_cached_oldest_tid()const{
+	const TableMapping * ma = mapping.load();
+	return ma ? ma->header->oldest_tid : 0;
+}
+
+void ReaderTable::publish_newest_meta(const MetaPage & newest_mp, os::File & lock_file, size_t granularity){
+	const TableMapping * ma = mapping.load();
+	if(!ma)
+		ma = grow_reader_table(lock_file, granularity, nullptr);
+	volatile LockFileHeader * header = ma->header;
+	const uint64_t seq = header->meta_seq | 1; // writer could crash while publishing, leaving odd meta_seq
+	header->meta_seq = seq;
+	__sync_synchronize();
+	memcpy(const_cast<MetaPage *>(&header->newest_meta), &newest_mp, sizeof(MetaPage));
+	__sync_synchronize();
+	header->meta_seq = seq + 1;
+}
+
+void ReaderTable::notify_commit(){
+	volatile LockFileHeader * header = mapping.load()->header;
+	__sync_fetch_and_add(&header->commit_seq, 1);
+	if( header->commit_waiters != 0 ) // waiters increment counter before sleeping, full barrier above orders our read
+		os::futex_wake(&header->commit_seq);
+}
+
+uint32_t ReaderTable::get_commit_seq(os::File & lock_file, size_t granularity){
+	const TableMapping * ma = mapping.load();
+	if(!ma)
+		ma = grow_reader_table(lock_file, granularity, nullptr);
+	const uint32_t seq = ma->header->commit_seq;
+	__sync_synchronize(); // we must read seq before checking newest tid
+	return seq;
+}
+
+void ReaderTable::wait_commit_seq(uint32_t seq, uint32_t timeout_ms){
+	volatile LockFileHeader * header = mapping.load()->header;
+	__sync_fetch_and_add(&header->commit_waiters, 1);
+	os::futex_wait(&header->commit_seq, seq, timeout_ms);
+	__sync_fetch_and_sub(&header->commit_waiters, 1);
+}
+
+uint64_t ReaderTable::take_writer_ticket(os::File & lock_file, size_t granularity){
+	const TableMapping * ma = mapping.load();
+	if(!ma)
+		ma = grow_reader_table(lock_file, granularity, nullptr);
+	return __sync_fetch_and_add(&ma->header->next_ticket, 1);
+}
+
+static void advance_writer_queue(volatile LockFileHeader * header, uint64_t ticket){
+	if( !__sync_bool_compare_and_swap(&header->now_serving, ticket, ticket + 1) )
+		return; // we were skipped
+	volatile uint32_t * turn = &header->turns[(ticket + 1) % WRITER_QUEUE_SLOTS];
+	__sync_fetch_and_add(turn, 1);
+	os::futex_wake(turn);
+}
+
+size_t ReaderTable::wait_writer_turn(uint64_t ticket, os::File & data_file, uint32_t stall_ms){
+	volatile LockFileHeader * header = mapping.load()->header;
+	volatile uint32_t * turn = &header->turns[ticket % WRITER_QUEUE_SLOTS];
+	size_t skipped = 0;
+	uint64_t last_serving = header->now_serving;
+	auto last_progress = std::chrono::steady_clock::now();
+	while(true){
+		const uint32_t turn_value = *turn; // read before now_serving, so we do not miss wake
+		__sync_synchronize();
+		const uint64_t serving = header->now_serving;
+		if( serving >= ticket ) // > if we were skipped as dead
+			return skipped;
+		const auto now_time = std::chrono::steady_clock::now();
+		if( serving != last_serving ){
+			last_serving = serving;
+			last_progress = now_time;
+		}else if( now_time - last_progress >= std::chrono::milliseconds(stall_ms) ){
+			last_progress = now_time;
+			// Live owner either holds flock or is about to take it, rare false positive only costs fairness
+			if( os::FileLock(data_file, false).is_locked() ){
+				advance_writer_queue(header, serving);
+				skipped += 1;
+			}
+			continue;
+		}
+		os::futex_wait(turn, turn_value, std::min<uint32_t>(stall_ms, 100));
 	}
 }
 
-void ReaderTable::grow_reader_table(os::File & lock_file, size_t granularity, bool grow_file){
-	uint64_t old_file_size = lock_file.get_size();
-	if(mapping_size != 0 && old_file_size == mapping_size && !grow_file)
-		return;
-	free_mapping();
-	uint64_t file_size = old_file_size;
-	if(grow_file || file_size == 0){ // If not, it was resized by another reader, we just create new mapping
+void ReaderTable::release_writer_ticket(uint64_t ticket){
+	advance_writer_queue(mapping.load()->header, ticket);
+}
+
+uint64_t ReaderTable::get_meta_seq(os::File & lock_file, size_t granularity){
+	const TableMapping * ma = mapping.load();
+	if(!ma)
+		ma = grow_reader_table(lock_file, granularity, nullptr);
+	const uint64_t seq = ma->header->meta_seq;
+	__sync_synchronize(); // we must read seq before reading newest meta
+	return seq;
+}
+
+bool ReaderTable::read_newest_meta(MetaPage * newest_mp)const{
+	const TableMapping * ma = mapping.load();
+	if(!ma)
+		return false;
+	const volatile LockFileHeader * header = ma->header;
+	for(int attempt = 0; attempt != 4; ++attempt){
+		const uint64_t seq = header->meta_seq;
+		if( seq == 0 )
+			return false;
+		if( seq % 2 != 0 )
+			continue;
+		__sync_synchronize();
+		memcpy(newest_mp, const_cast<const MetaPage *>(&header->newest_meta), sizeof(MetaPage));
+		__sync_synchronize();
+		if( header->meta_seq == seq )
+			return true;
+	}
+	return false; // writer is busy, reading meta pages is cheaper than waiting
+}
+
+void ReaderTable::free_mappings(){
+	mapping = nullptr;
+	for(auto && ma : mappings)
+		munmap(ma->addr, ma->size);
+	mappings.clear();
+}
+
+const ReaderTable::TableMapping * ReaderTable::grow_reader_table(os::File & lock_file, size_t granularity, const TableMapping * full){
+	std::unique_lock<std::mutex> lock(mu);
+	const TableMapping * ma = mapping.load();
+	if(full && ma != full)
+		return ma; // other thread grew table while we were waiting on lock
+	uint64_t file_size = lock_file.get_size();
+	if(ma && file_size == ma->size && !full)
+		return ma;
+	if(full || file_size == 0){ // If not, it was resized by another reader, we just create new mapping
 		if(granularity < 4096)
 			granularity = 4096; // Do not grow too slowly or too fast
 		file_size = os::grow_to_granularity(file_size + granularity, granularity);
 		lock_file.set_size(file_size);
 	}
-	mapping = lock_file.mmap(0, file_size, true, true);
-	mapping_size = file_size;
-	slots = (volatile ReaderSlot *)mapping + 1;
-	slots_count = (mapping_size - sizeof(ReaderSlot)) / sizeof(ReaderSlot);
-	header = (volatile LockFileHeader *)mapping;
-	header->magic = META_MAGIC;
+	std::unique_ptr<TableMapping> new_ma(new TableMapping{});
+	new_ma->addr = lock_file.mmap(0, file_size, true, true);
+	new_ma->size = file_size;
+	new_ma->slots = (volatile ReaderSlot *)(new_ma->addr + sizeof(LockFileHeader));
+	new_ma->slots_count = (new_ma->size - sizeof(LockFileHeader)) / sizeof(ReaderSlot);
+	new_ma->header = (volatile LockFileHeader *)new_ma->addr;
+	if( new_ma->header->magic != LOCK_MAGIC && new_ma->header->magic != 0 ){
+		munmap(new_ma->addr, new_ma->size);
+		Exception::th("Lock file has incompatible format - it can be removed when DB is not used by any process");
+	}
+	new_ma->header->magic = LOCK_MAGIC;
+	mappings.push_back(std::move(new_ma));
+	mapping = mappings.back().get();
+	return mappings.back().get();
 }
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
 #include "pages.hpp"
 #include "os.hpp"
 
@@ -11,13 +15,34 @@ namespace mustela {
 		uint32_t now = 0;
 		uint32_t deadline = 0; // Unix time seconds
 	};
+	constexpr uint64_t LOCK_MAGIC = 0x4e616c657473754d; // MustelaN in LE
+	constexpr size_t LOCK_HEADER_SIZE = 16 * READER_SLOT_SIZE;
+	constexpr size_t NEWEST_META_SIZE = 2 * READER_SLOT_SIZE;
+	constexpr size_t WRITER_QUEUE_SIZE = READER_SLOT_SIZE;
+	constexpr size_t WRITER_QUEUE_SLOTS = (WRITER_QUEUE_SIZE - 2 * sizeof(uint64_t)) / sizeof(uint32_t);
+	constexpr size_t READER_BLOCK_SLOTS = 64; // 1 occupancy bit per block of slots
+	constexpr size_t OCCUPANCY_WORDS = (LOCK_HEADER_SIZE - READER_SLOT_SIZE - NEWEST_META_SIZE - WRITER_QUEUE_SIZE) / sizeof(uint64_t);
+	constexpr size_t OCCUPANCY_BITS = OCCUPANCY_WORDS * 64; // last bit covers all blocks beyond
 #pragma pack(push, 1)
 	struct LockFileHeader {
 		uint64_t next_reader;
 		uint64_t magic;
-		char padding[READER_SLOT_SIZE - 2*sizeof(uint64_t)]; // cache line optimization
+		Tid oldest_tid; // low watermark computed by last writer
+		char padding[READER_SLOT_SIZE - 2*sizeof(uint64_t) - sizeof(Tid)]; // cache line optimization
+		// Copy of newest meta page published by writer after commit, odd meta_seq means writer is changing it
+		uint64_t meta_seq;
+		MetaPage newest_meta;
+		uint32_t commit_seq; // futex word, incremented after each commit
+		uint32_t commit_waiters; // writer skips futex wake if zero
+		char meta_padding[NEWEST_META_SIZE - sizeof(uint64_t) - sizeof(MetaPage) - 2*sizeof(uint32_t)];
+		// Ticket lock for FIFO order of writers from all processes, data file flock still provides exclusion
+		uint64_t next_ticket;
+		uint64_t now_serving;
+		uint32_t turns[WRITER_QUEUE_SLOTS]; // futex words, writer with ticket t sleeps on turns[t % WRITER_QUEUE_SLOTS]
+		// Readers set bit after grabbing slot in block, writer clears bit before scanning block and sets it back if block has live slots
+		uint64_t occupied[OCCUPANCY_WORDS];
 	};
-	static_assert(sizeof(LockFileHeader) == READER_SLOT_SIZE, "");
+	static_assert(sizeof(LockFileHeader) == LOCK_HEADER_SIZE, "");
 	struct ReaderSlot {
 		uint64_t ridead; // reader id + deadline in seconds as returned by std::steady_clock
 		Tid tid;
@@ -25,17 +50,25 @@ namespace mustela {
 	};
 	static_assert(sizeof(ReaderSlot) == READER_SLOT_SIZE, "");
 #pragma pack(pop)
-	// All operations in ReaderTable instance is protected by mutex in DB
+	// Slot operations are lock-free and can be called from any thread, growing table is protected by own mutex
+	// Old mappings are kept until destruction, so slots found by other threads in old mapping remain valid
+	// (all mappings are shared, so they see the same memory)
 	class ReaderTable {
-		char * mapping = nullptr;
-		size_t mapping_size = 0;
-		volatile LockFileHeader * header = nullptr;
-		volatile ReaderSlot * slots = 0;
-		size_t slots_count = 0;
-		
-		Random random;
-		void grow_reader_table(os::File & lock_file, size_t granularity, bool grow_file);
-		void free_mapping();
+		struct TableMapping {
+			char * addr = nullptr;
+			size_t size = 0;
+			volatile LockFileHeader * header = nullptr;
+			volatile ReaderSlot * slots = nullptr;
+			size_t slots_count = 0;
+		};
+		std::mutex mu;
+		std::vector<std::unique_ptr<TableMapping>> mappings;
+		std::atomic<const TableMapping *> mapping{nullptr};
+		const uint64_t instance_id; // key of thread-local sticky slot, unlike this pointer it is never reused
+
+		// full != nullptr - grow file, unless other thread already replaced full mapping
+		const TableMapping * grow_reader_table(os::File & lock_file, size_t granularity, const TableMapping * full);
+		void free_mappings();
 	public:
 		explicit ReaderTable();
 		~ReaderTable();
@@ -44,8 +77,25 @@ namespace mustela {
 
 		ReaderSlotDesc create_reader_slot(Tid tid, uint32_t reader_timeout_seconds, os::File & lock_file, size_t granularity);
 		bool update_reader_slot(ReaderSlotDesc & slot, uint32_t now, uint32_t reader_timeout_seconds); // false if we were too late and slot was grabbed from us
+		bool renew_reader_slot(ReaderSlotDesc & slot, Tid tid, uint32_t reader_timeout_seconds); // prolongs slot and sets tid, false if slot was grabbed from us
 		void release_reader_slot(const ReaderSlotDesc & slot);
-		Tid find_oldest_tid(Tid writer_tid, os::File & lock_file, size_t granularity);
+		// visits only blocks marked as occupied, appends tids of live readers to live_tids if not null
+		Tid find_oldest_tid(Tid writer_tid, os::File & lock_file, size_t granularity, std::vector<Tid> * live_tids = nullptr);
+		Tid get_cached_oldest_tid()const; // as computed by last writer, 0 if unknown
+		// Only writer publishes, readers must check that meta page newest_mp.pid still has the same tid
+		void publish_newest_meta(const MetaPage & newest_mp, os::File & lock_file, size_t granularity);
+		bool read_newest_meta(MetaPage * newest_mp)const; // false if never published or writer is publishing
+		uint64_t get_meta_seq(os::File & lock_file, size_t granularity); // changes on each publish
+
+		void notify_commit(); // called by writer after publish_newest_meta
+		uint32_t get_commit_seq(os::File & lock_file, size_t granularity);
+		void wait_commit_seq(uint32_t seq, uint32_t timeout_ms); // returns early if commit_seq != seq, spurious wakes possible
+
+		uint64_t take_writer_ticket(os::File & lock_file, size_t granularity);
+		// If queue does not move for stall_ms and data file is not locked, owner of current ticket is dead and is skipped
+		// returns number of skipped tickets
+		size_t wait_writer_turn(uint64_t ticket, os::File & data_file, uint32_t stall_ms);
+		void release_writer_ticket(uint64_t ticket);
 	};
 }
 
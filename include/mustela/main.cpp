@@ -3,6 +3,7 @@
 
 #include <iostream>
 #include <fstream>
+#include <algorithm>
 #include <map>
 #include <set>
 #include <unordered_set>
@@ -360,17 +361,13 @@ void run_bank(const std::string & db_path, size_t thread_counter){
 			}
 			last_tid = txn.tid();
 			uint64_t acc = random.rnd() % ACCOUNTS;
-			uint64_t aaa = 0;
-			if( main_bucket.get(Val(std::to_string(acc)), &a_value)){
-				aaa = std::stoull(a_value.to_string());
-//				uint64_t prev = aaa;
-//				bank += aaa / 2;
-//				aaa = prev - aaa / 2;
-			}
 			uint64_t minus = bank/1000000;
 			bank -= minus;
-			aaa += minus;
-			ass(main_bucket.put(Val(std::to_string(acc)), Val(std::to_string(aaa)), false), "Bad put in bank");
+			main_bucket.update(Val(std::to_string(acc)), [&](const Val * value, std::string * new_value){
+				uint64_t aaa = value ? std::stoull(value->to_string()) : 0;
+				*new_value = std::to_string(aaa + minus);
+				return Bucket::Update::PUT;
+			});
 			ass(main_bucket.put(Val("bank"), Val(std::to_string(bank)), false), "Bad put in bank");
 			txn.commit();
 //			sleep(1);
@@ -430,6 +427,28 @@ void run_benchmark(const std::string & db_path){
 	}
 	{
 	auto idea_start  = std::chrono::high_resolution_clock::now();
+	TX txn(db, true);
+	Bucket main_bucket = txn.get_bucket(Val("main"));
+	std::vector<Scanner> scanners = main_bucket.get_scanners(std::thread::hardware_concurrency());
+	std::vector<size_t> counters(scanners.size());
+	std::vector<std::thread> threads;
+	for(size_t i = 0; i != scanners.size(); ++i)
+		threads.emplace_back([&scanners, &counters, i](){
+			Val key, value;
+			for(Scanner & sc = scanners.at(i); sc.get(&key, &value); sc.next())
+				counters.at(i) += 1;
+		});
+	size_t scan_counter = 0;
+	for(size_t i = 0; i != threads.size(); ++i){
+		threads.at(i).join();
+		scan_counter += counters.at(i);
+	}
+	auto idea_ms =
+	    std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - idea_start);
+	std::cout << "Parallel scan of " << scan_counter << " items in " << scanners.size() << " partitions, seconds=" << double(idea_ms.count()) / 1000 << std::endl;
+	}
+	{
+	auto idea_start  = std::chrono::high_resolution_clock::now();
 	TX txn(db);
 	Bucket main_bucket = txn.get_bucket(Val("main"));
 	uint8_t keybuf[32] = {};
@@ -761,6 +780,19 @@ int main(int argc, char * argv[]){
 	benchmark_op("std::uset count ", to_count, [&](uint64_t sample)->size_t{ return test_uset.count(sample); });
 	benchmark_op("std::uset erase ", to_count, [&](uint64_t sample)->size_t{ return test_uset.erase(sample); });
 
+	std::vector<uint64_t> extents(count);
+	for(size_t i = 0; i != count; ++i)
+		extents[i] = i;
+	std::shuffle(extents.begin(), extents.end(), std::mt19937(4));
+	const Pid extents_file_size = 4 + 3 * count;
+	MergablePageCache test_cache(true);
+	benchmark_op("free extents add ", extents, [&](uint64_t sample)->size_t{ test_cache.add_to_cache(4 + 3*sample, 1 + sample % 2, extents_file_size); return 1; });
+	benchmark_op("free extents get ", extents, [&](uint64_t sample)->size_t{ return test_cache.get_free_page(1 + sample % 2, false, extents_file_size) != 0; });
+	MergablePageCache large_cache(true); // fragmented file with multi-page extents, requests fall into non-exact bins
+	const Pid large_file_size = 4 + 300 * count;
+	benchmark_op("free large extents add ", extents, [&](uint64_t sample)->size_t{ large_cache.add_to_cache(4 + 300*sample, 64 + sample % 200, large_file_size); return 1; });
+	benchmark_op("free large extents get ", extents, [&](uint64_t sample)->size_t{ return large_cache.get_free_page(64 + (sample * 7) % 150, false, large_file_size) != 0; });
+
 //	SkipList<uint64_t> skip_list;
 //	benchmark_op("skip_list insert ", to_insert, [&](uint64_t sample)->size_t{ return skip_list.insert(sample).second; });
 //	benchmark_op("skip_list count ", to_count, [&](uint64_t sample)->size_t{ return skip_list.count(sample); });
@@ -4,3 +4,6 @@
 #include "tx.hpp"
 #include "bucket.hpp"
 #include "cursor.hpp"
+#include "scanner.hpp"
+#include "snapshot.hpp"
+#include "batch.hpp"
@@ -10,6 +10,13 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <errno.h>
+#include <climits>
+#include <algorithm>
+#ifdef __linux__
+#include <linux/falloc.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
 using namespace mustela;
 
@@ -49,27 +56,79 @@ void os::File::munmap(char * addr, uint64_t size){
 void os::File::msync(char * addr, uint64_t size){
 	::msync(addr, size, MS_SYNC);
 }
+bool os::File::punch_hole(uint64_t offset, uint64_t size){
+	int result = 0;
+#if defined(__linux__)
+	do{
+		result = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(offset), static_cast<off_t>(size));
+ 	}while(result < 0 && errno == EINTR);
+#elif defined(F_PUNCHHOLE)
+	fpunchhole_t ph{};
+	ph.fp_offset = static_cast<off_t>(offset);
+	ph.fp_length = static_cast<off_t>(size);
+	do{
+		result = fcntl(fd, F_PUNCHHOLE, &ph);
+ 	}while(result < 0 && errno == EINTR);
+#else
+	result = -1;
+#endif
+	return result == 0;
+}
+void os::File::discard(char * addr, uint64_t size){
+	::madvise(addr, size, MADV_DONTNEED);
+}
+void os::File::get_identity(uint64_t * dev, uint64_t * ino)const{
+	struct stat st;
+	if( fstat(fd, &st) != 0 )
+		throw Exception("getting file identity error");
+	*dev = static_cast<uint64_t>(st.st_dev);
+	*ino = static_cast<uint64_t>(st.st_ino);
+}
 
 os::File::~File(){
 	close(fd); fd = -1;
 }
 
-os::FileLock::FileLock(File & file):fd(file.fd){
+os::FileLock::FileLock(File & file, bool wait):fd(file.fd){
 	int result = 0;
 	do{
- 		result = flock(fd, LOCK_EX);
+ 		result = flock(fd, wait ? LOCK_EX : (LOCK_EX | LOCK_NB));
  	}while(result < 0 && errno == EINTR);
+	if( !wait && result < 0 && errno == EWOULDBLOCK ){
+		fd = -1;
+		return;
+	}
 	ass(result == 0, "Failed to exclusively lock file");
 }
 
 os::FileLock::~FileLock(){
+	if( fd == -1 )
+		return;
 	int result = 0;
 	do{
  		result = flock(fd, LOCK_UN);
- 	}while(errno == EINTR);
+ 	}while(result < 0 && errno == EINTR);
 	ass(result == 0, "Failed to exclusively lock file");
 }
 
+void os::futex_wait(volatile uint32_t * addr, uint32_t value, uint32_t timeout_ms){
+#ifdef __linux__
+	timespec ts;
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = long(timeout_ms % 1000) * 1000000;
+	syscall(SYS_futex, const_cast<uint32_t *>(addr), FUTEX_WAIT, value, &ts, nullptr, 0); // not private, works between processes
+#else
+	if( *addr == value )
+		usleep(1000 * std::min<uint32_t>(timeout_ms, 1));
+#endif
+}
+
+void os::futex_wake(volatile uint32_t * addr){
+#ifdef __linux__
+	syscall(SYS_futex, const_cast<uint32_t *>(addr), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#endif
+}
+
 bool mustela::os::file_exists_on_readonly_partition(const std::string & file_path){
 	int fd;
 	do{
@@ -86,6 +145,15 @@ bool mustela::os::file_exists_on_readonly_partition(const std::string & file_pat
 	return (result >= 0) && (buf.f_flag & ST_RDONLY);
 }
 
+bool mustela::os::get_file_identity(const std::string & file_path, uint64_t * dev, uint64_t * ino){
+	struct stat st;
+	if( stat(file_path.c_str(), &st) != 0 )
+		return false;
+	*dev = static_cast<uint64_t>(st.st_dev);
+	*ino = static_cast<uint64_t>(st.st_ino);
+	return true;
+}
+
 size_t mustela::os::get_physical_page_size(){
 	return static_cast<size_t>(sysconf(_SC_PAGESIZE));
 }
@@ -12,17 +12,25 @@ namespace mustela { namespace os {
 		char * mmap(uint64_t offset, uint64_t size, bool read, bool write);
 		void munmap(char * addr, uint64_t size);
 		void msync(char * addr, uint64_t size);
+		bool punch_hole(uint64_t offset, uint64_t size); // gives blocks back to file system, false if not supported
+		void discard(char * addr, uint64_t size); // drops mapped pages, they will be read from file again
+		void get_identity(uint64_t * dev, uint64_t * ino)const;
 
 //		explicit File(int fd):fd(fd) {}
 		~File();
 	};
 	struct FileLock {
 		int fd;
-		explicit FileLock(File & file);
+		explicit FileLock(File & file, bool wait = true);
+		bool is_locked()const { return fd != -1; } // false only if wait was false and file was locked
 		~FileLock();
 	};
+	// Works between processes on shared mappings, falls back to sleeping where futex is not available
+	void futex_wait(volatile uint32_t * addr, uint32_t value, uint32_t timeout_ms);
+	void futex_wake(volatile uint32_t * addr); // wakes all
 	
 	bool file_exists_on_readonly_partition(const std::string & file_path); // Do not use reader lock table if it is
+	bool get_file_identity(const std::string & file_path, uint64_t * dev, uint64_t * ino); // false if file does not exist
 	
 	size_t get_physical_page_size();
 	size_t get_map_granularity(); // Can be larger than page size
@@ -246,6 +246,17 @@ size_t CLeafPtr::get_item_size(int item, Pid & overflow_page, Pid & overflow_cou
 	overflow_count = (valuesize + page_size - 1)/page_size;
 	return kvs_size + NODE_PID_SIZE + sizeof(Tid);
 }
+void LeafPtr::set_overflow_page(int item, Pid overflow_page, Tid overflow_tid){
+	Pid old_page, old_count;
+	Tid old_tid;
+	get_item_size(item, old_page, old_count, old_tid);
+	ass(old_page != 0, "set_overflow_page of item without overflow");
+	MVal key = get_key(item);
+	uint64_t valuesize;
+	auto valuesizesize = read_u64_sqlite4(valuesize, key.end());
+	pack_uint_le(key.end() + valuesizesize, NODE_PID_SIZE, overflow_page);
+	pack_uint_le(key.end() + valuesizesize + NODE_PID_SIZE, sizeof(Tid), overflow_tid);
+}
 ValVal CLeafPtr::get_kv(int item, Pid & overflow_page)const{
 	ValVal result;
 	result.key = get_key(item);
@@ -265,6 +265,7 @@ namespace mustela {
 		}
 		void compact(size_t item_size);
 		char * insert_at(int insert_index, Val key, size_t value_size, bool & overflow);
+		void set_overflow_page(int item, Pid overflow_page, Tid overflow_tid); // item must be overflow already
 		void insert_at(int insert_index, Val key, Val value){
 			bool overflow = false;
 			char * dst = insert_at(insert_index, key, value.size, overflow);
@@ -0,0 +1,77 @@
+#include "mustela.hpp"
+
+using namespace mustela;
+
+Scanner::Scanner(std::shared_ptr<Snapshot> snapshot, const std::atomic<uint32_t> * coarse_now, const BucketDesc * bucket_desc, const std::string & begin_key, const std::string * end_key):
+	snapshot(snapshot), coarse_now(coarse_now), slot_now(snapshot->slot_now.load(std::memory_order_relaxed)),
+	c_file_ptr(snapshot->c_file_ptr), file_page_count(snapshot->file_page_count), page_size(snapshot->meta_page.page_size), height(bucket_desc->height),
+	begin_key(begin_key), end_key(end_key ? *end_key : std::string()), has_end(end_key != nullptr), path(bucket_desc->height + 1){
+	// same as Cursor::seek, empty begin_key sets to first item
+	Pid pa = bucket_desc->root_page;
+	for(size_t he = height; he != 0; --he){
+		CNodePtr nap = readable_node(pa);
+		int nitem = nap.upper_bound_item(Val(this->begin_key)) - 1;
+		path.at(he) = Element{pa, nitem};
+		pa = nap.get_value(nitem);
+	}
+	CLeafPtr dap = readable_leaf(pa);
+	bool found;
+	path.at(0) = Element{pa, dap.lower_bound_item(Val(this->begin_key), &found)};
+}
+void Scanner::update_reader_slot(){
+	uint32_t now = coarse_now ? coarse_now->load(std::memory_order_relaxed) : ReaderTable::now();
+	if( now == slot_now )
+		return;
+	snapshot->update_reader_slot(now); // throws if slot was lost
+	slot_now = now;
+}
+bool Scanner::fix_scanner_after_last_item(){
+	CLeafPtr dap = readable_leaf(path.at(0).pid);
+	if(path.at(0).item < dap.size())
+		return true;
+	size_t he = 1;
+	Pid pa = 0;
+	while(true){
+		if( he == height + 1 )
+			return false;
+		CNodePtr nap = readable_node(path.at(he).pid);
+		if( path.at(he).item + 1 < nap.size() ){
+			path.at(he).item += 1;
+			pa = nap.get_value(path.at(he).item);
+			break;
+		}
+		he += 1;
+	}
+	for(he -= 1; he != 0; --he){
+		CNodePtr nap = readable_node(pa);
+		path.at(he) = Element{pa, -1};
+		pa = nap.get_value(-1);
+	}
+	path.at(0) = Element{pa, 0};
+	return true;
+}
+bool Scanner::get(Val * key, Val * value){
+	ass(is_valid(), "Scanner not valid");
+	update_reader_slot();
+	if( !fix_scanner_after_last_item() )
+		return false;
+	CLeafPtr dap = readable_leaf(path.at(0).pid);
+	Pid overflow_page;
+	auto kv = dap.get_kv(path.at(0).item, overflow_page);
+	if( has_end && !(kv.key < Val(end_key)) )
+		return false;
+	if( overflow_page ){
+		Pid overflow_count = (kv.value.size + page_size - 1)/page_size;
+		kv.value.data = (const char *)readable_page(overflow_page, overflow_count);
+	}
+	*key = kv.key;
+	*value = kv.value;
+	return true;
+}
+void Scanner::next(){
+	ass(is_valid(), "Scanner not valid");
+	update_reader_slot();
+	if( !fix_scanner_after_last_item() )
+		return;
+	path.at(0).item += 1;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include "pages.hpp"
+
+namespace mustela {
+
+	// Forward-only iterator over [begin_key, end_key) of a bucket in read-only transaction
+	// Does not register in TX, so different scanners can be used from different threads.
+	// Scanners share Snapshot, which keeps reader slot and mapping, so they can outlive TX
+	class Scanner {
+	public:
+		Scanner(){}
+
+		bool is_valid()const { return c_file_ptr != nullptr; }
+		Val get_begin_key()const { return Val(begin_key); } // empty for first partition
+		Val get_end_key()const { return Val(end_key); } // empty for last partition
+		bool has_end_key()const { return has_end; }
+
+		bool get(Val * key, Val * value); // false at the end of partition
+		void next();
+		// for( ; sc.get(&key, &value); sc.next() ) {}
+	private:
+		friend class Bucket;
+		explicit Scanner(std::shared_ptr<Snapshot> snapshot, const std::atomic<uint32_t> * coarse_now, const BucketDesc * bucket_desc, const std::string & begin_key, const std::string * end_key);
+
+		std::shared_ptr<Snapshot> snapshot;
+		const std::atomic<uint32_t> * coarse_now = nullptr; // set if DB has heartbeat thread
+		uint32_t slot_now = 0; // last time we prolonged snapshot slot
+		void update_reader_slot();
+
+		const char * c_file_ptr = nullptr;
+		Pid file_page_count = 0;
+		size_t page_size = 0;
+		size_t height = 0;
+
+		std::string begin_key;
+		std::string end_key;
+		bool has_end = false;
+
+		struct Element {
+			Pid pid = 0;
+			int item = 0;
+		};
+		std::vector<Element> path;
+
+		const DataPage * readable_page(Pid page, Pid count)const{
+			ass(page + count <= file_page_count, "Constant mapping should always cover the whole file");
+			return (const DataPage *)(c_file_ptr + page * page_size);
+		}
+		CLeafPtr readable_leaf(Pid pa)const{
+			return CLeafPtr(page_size, (const LeafPage *)readable_page(pa, 1));
+		}
+		CNodePtr readable_node(Pid pa)const{
+			return CNodePtr(page_size, (const NodePage *)readable_page(pa, 1));
+		}
+		bool fix_scanner_after_last_item(); // true if points to item
+	};
+}
+
@@ -0,0 +1,30 @@
+#include "mustela.hpp"
+
+using namespace mustela;
+
+Snapshot::Snapshot(DB & my_db):my_db(my_db) {
+	meta_seq = my_db.core->reader_table.get_meta_seq(my_db.core->lock_file, my_db.core->map_granularity);
+	my_db.core->start_snapshot(this);
+	slot_now = reader_slot.now;
+}
+Snapshot::Snapshot(const TX & tx):my_db(tx.my_db) {
+	my_db.core->start_snapshot(this, tx);
+	slot_now = reader_slot.now;
+}
+Snapshot::~Snapshot(){
+	my_db.core->finish_snapshot(this);
+}
+ReaderSlotDesc Snapshot::get_reader_slot(){
+	std::unique_lock<std::mutex> lock(slot_mu);
+	return reader_slot;
+}
+void Snapshot::update_reader_slot(uint32_t now){
+	if( slot_now.load(std::memory_order_relaxed) == now )
+		return; // other thread already prolonged slot this second
+	std::unique_lock<std::mutex> lock(slot_mu);
+	if( reader_slot.now == now )
+		return;
+	if( !my_db.core->reader_table.update_reader_slot(reader_slot, now, my_db.options.reader_timeout_seconds) )
+		Exception::th("Timeout in reader transaction - consider increasing read interval in DBOptions");
+	slot_now.store(now, std::memory_order_relaxed);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include "pages.hpp"
+#include "lock.hpp"
+
+namespace mustela {
+
+	// Read-only view of DB, which can be shared between threads. Holds reader slot and mapping
+	// Each thread creates own TX(snapshot), so buckets and cursors stay thread-local
+	// auto snapshot = std::make_shared<Snapshot>(db);
+	// for(...) threads.emplace_back([snapshot](){ TX txn(snapshot); ... });
+	class Snapshot {
+	public:
+		explicit Snapshot(DB & my_db);
+		~Snapshot();
+		Snapshot(const Snapshot &) = delete;
+		Snapshot & operator=(const Snapshot &) = delete;
+		Tid tid()const{ return meta_page.tid; }
+	private:
+		friend class TX;
+		friend class DB;
+		friend class DBCore;
+		friend class Bucket;
+		friend class Scanner;
+		explicit Snapshot(const TX & tx); // same tid and mapping as read-only tx, but own reader slot
+
+		DB & my_db;
+		const char * c_file_ptr = nullptr;
+		Pid file_page_count = 0;
+		Mapping * c_mapping = nullptr;
+		MetaPage meta_page;
+
+		std::mutex slot_mu; // protects reader_slot, taken once per second per thread at most
+		ReaderSlotDesc reader_slot;
+		std::atomic<uint32_t> slot_now{0}; // copy of reader_slot.now for lock-free check
+		uint64_t meta_seq = 0; // if lock file meta_seq did not change since, snapshot is still the newest one
+
+		ReaderSlotDesc get_reader_slot();
+		void update_reader_slot(uint32_t now);
+	};
+}
+
@@ -1,10 +1,12 @@
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <iostream>
 #include <iterator>
 #include <memory>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 #include <csignal>
 #include "mustela.hpp"
@@ -96,6 +98,39 @@ namespace {
         return to_hex(h, sizeof h);
     }
 
+    // Same as db_hash, but buckets are read by partition scanners, which must follow each other without gaps
+    std::string db_scan_hash(mustela::TX& tx, size_t count) {
+        auto ctx = blake2b_ctx{};
+        auto ret = blake2b_init(&ctx, 32, nullptr, 0);
+        assert(ret == 0);
+
+        for (auto name: tx.get_bucket_names()) {
+            blake2b_update_val(&ctx, 'b', name);
+
+            mustela::Bucket b = tx.get_bucket(name, false);
+            auto scanners = b.get_scanners(count);
+            assert(!scanners.empty() && scanners.size() <= count);
+            assert(scanners.front().get_begin_key().size == 0 && !scanners.back().has_end_key());
+            for (size_t i = 0; i != scanners.size(); i++) {
+                auto& sc = scanners[i];
+                if (i + 1 != scanners.size()) {
+                    assert(sc.has_end_key() && sc.get_end_key() == scanners[i + 1].get_begin_key());
+                }
+                mustela::Val k, v;
+                for (; sc.get(&k, &v); sc.next()) {
+                    assert(k >= sc.get_begin_key() && (!sc.has_end_key() || k < sc.get_end_key()));
+                    blake2b_update_val(&ctx, 'k', k);
+                    blake2b_update_val(&ctx, 'v', v);
+                }
+            }
+        }
+
+        uint8_t h[32] = {};
+        blake2b_final(&ctx, &h);
+
+        return to_hex(h, sizeof h);
+    }
+
     struct test_state {
         std::string db_path;
         std::unique_ptr<mustela::DB> db;
@@ -103,6 +138,7 @@ namespace {
         std::vector<std::unique_ptr<mustela::TX>> read_txs;
         std::map<bytes, mustela::Bucket> buckets;
         std::map<bytes, mustela::Cursor> cursors;
+        size_t drop_pages_per_commit = 0;
 
         explicit test_state(std::string db_path) : db_path(std::move(db_path)) {
             reset();
@@ -132,6 +168,7 @@ namespace {
             mustela::DBOptions options;
             options.new_db_page_size = mustela::MIN_PAGE_SIZE;
             options.minimal_mapping_size = 256; // Small increase of mapped region == lots of mmap/munmap when DB grows
+            options.drop_pages_per_commit = drop_pages_per_commit;
             db = std::make_unique<mustela::DB>(db_path, options);
 
             tx = std::make_unique<mustela::TX>(*db, false);
@@ -168,6 +205,88 @@ namespace {
             return (*it).second;
         }
 
+        // Reader which keeps reading must keep its slot past reader_timeout_seconds,
+        // two DB objects share one heartbeat thread of their core
+        void check_reader_heartbeat() {
+            auto path = db_path + ".heartbeat";
+            mustela::DB::remove_db(path);
+            {
+                mustela::DBOptions options;
+                options.new_db_page_size = mustela::MIN_PAGE_SIZE;
+                options.reader_timeout_seconds = 1;
+                options.reader_heartbeat = true;
+                mustela::DB reader_db(path, options);
+                mustela::DB writer_db(path, options);
+                {
+                    mustela::TX wtx(writer_db);
+                    wtx.get_bucket(mustela::Val("main")).put(mustela::Val("key"), mustela::Val("value"), false);
+                    wtx.commit();
+                }
+                mustela::TX rtx(reader_db, true);
+                mustela::Bucket bucket = rtx.get_bucket(mustela::Val("main"), false);
+                auto start = std::chrono::steady_clock::now();
+                while (std::chrono::steady_clock::now() - start < std::chrono::seconds(3)) {
+                    mustela::Val value;
+                    bool found = bucket.get(mustela::Val("key"), &value);
+                    assert(found && value == mustela::Val("value"));
+                    mustela::TX wtx(writer_db);
+                    assert(wtx.debug_get_oldest_reader_tid() <= rtx.tid());
+                    wtx.get_bucket(mustela::Val("main")).put(mustela::Val("key"), mustela::Val("other"), false);
+                    wtx.commit();
+                    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                }
+            }
+            mustela::DB::remove_db(path);
+        }
+
+        // Two batches against one DB, commit fails only if bucket read by batch was changed by others
+        void check_batch_conflicts() {
+            auto path = db_path + ".batch";
+            mustela::DB::remove_db(path);
+            {
+                mustela::DBOptions options;
+                options.new_db_page_size = mustela::MIN_PAGE_SIZE;
+                mustela::DB db(path, options);
+                mustela::WriteBatch first(db);
+                mustela::WriteBatch second(db);
+                mustela::Val value;
+                // read bucket changed by other batch
+                first.get(mustela::Val("read"), mustela::Val("key"), &value);
+                first.put(mustela::Val("read"), mustela::Val("key"), mustela::Val("first"));
+                second.put(mustela::Val("read"), mustela::Val("key"), mustela::Val("second"));
+                bool committed = second.commit();
+                assert(committed);
+                committed = first.commit();
+                assert(!committed && first.get_conflict_counter() == 1);
+                bool found = first.get(mustela::Val("read"), mustela::Val("key"), &value);
+                assert(found && value == mustela::Val("second"));
+                // blind writes to the same bucket, bucket read by us is unchanged
+                first.put(mustela::Val("blind"), mustela::Val("first"), mustela::Val("1"));
+                second.put(mustela::Val("blind"), mustela::Val("second"), mustela::Val("2"));
+                second.del(mustela::Val("read"), mustela::Val("missing"));
+                committed = second.commit();
+                assert(committed);
+                committed = first.commit();
+                assert(committed && first.get_conflict_counter() == 1);
+                found = first.get(mustela::Val("blind"), mustela::Val("second"), &value);
+                assert(found && value == mustela::Val("2"));
+                // bucket dropped and recreated with the same contents
+                first.get(mustela::Val("read"), mustela::Val("key"), &value);
+                first.put(mustela::Val("blind"), mustela::Val("third"), mustela::Val("3"));
+                {
+                    mustela::TX tx(db);
+                    tx.drop_bucket(mustela::Val("read"));
+                    tx.get_bucket(mustela::Val("read")).put(mustela::Val("key"), mustela::Val("second"), false);
+                    tx.commit();
+                }
+                committed = first.commit();
+                assert(!committed && first.get_conflict_counter() == 2);
+                found = first.get(mustela::Val("blind"), mustela::Val("third"), &value);
+                assert(!found);
+            }
+            mustela::DB::remove_db(path);
+        }
+
         std::string handle_test_command(std::vector<std::string> const &tokens) {
             auto cmd = get_nth_tok(tokens, 0);
             auto b = from_hex(get_nth_tok(tokens, 1));
@@ -216,6 +335,71 @@ namespace {
                         c.prev();
                     }
                 }
+            } else if (cmd == "del-range") {
+                auto c_key = from_hex(get_nth_tok(tokens, 4));
+                auto& bucket = obtain_bucket(b, false);
+                auto& c = obtain_cursor(b);
+                c.seek(mustela::Val(c_key));
+                bucket.del_range(mustela::Val(k), mustela::Val(v));
+                // cursor inside removed range must move to the first key after it
+                bool inside = !(c_key < k) && c_key < v;
+                auto expected = bucket.get_cursor();
+                expected.seek(mustela::Val(inside ? v : c_key));
+                assert(c == expected);
+                c.debug_check_cursor_path_up();
+            } else if (cmd == "update") {
+                auto op_bytes = from_hex(get_nth_tok(tokens, 4));
+                auto op = std::string(op_bytes.begin(), op_bytes.end());
+                auto& bucket = obtain_bucket(b, false);
+                int64_t n = 0;
+                if (v.size() == sizeof(n)) {
+                    for (size_t i = 0; i != v.size(); i++) {
+                        n |= static_cast<int64_t>(static_cast<uint64_t>(v[i]) << 8 * i);
+                    }
+                }
+                mustela::Bucket::UpdateFunction fn;
+                if (op == "add") {
+                    fn = mustela::Bucket::add_int64(n);
+                } else if (op == "max") {
+                    fn = mustela::Bucket::max_int64(n);
+                } else if (op == "min") {
+                    fn = mustela::Bucket::min_int64(n);
+                } else if (op == "append") {
+                    fn = mustela::Bucket::append(mustela::Val(v));
+                } else {
+                    fn = [](const mustela::Val*, std::string*) { return mustela::Bucket::Update::DEL; };
+                }
+                mustela::Val old;
+                bool had = bucket.get(mustela::Val(k), &old);
+                // integer operators must throw on wrong size value and leave it intact
+                bool must_throw = had && old.size != sizeof(n) && (op == "add" || op == "max" || op == "min");
+                bool thrown = false;
+                auto result = mustela::Bucket::Update::KEEP;
+                try {
+                    result = bucket.update(mustela::Val(k), fn);
+                } catch (const mustela::Exception&) {
+                    thrown = true;
+                }
+                assert(thrown == must_throw);
+                bool has = bucket.contains(mustela::Val(k));
+                if (result == mustela::Bucket::Update::KEEP) {
+                    assert(has == had);
+                } else {
+                    assert(has == (result == mustela::Bucket::Update::PUT));
+                }
+            } else if (cmd == "truncate") {
+                auto& c = obtain_cursor(b);
+                c.seek(mustela::Val(k));
+                obtain_bucket(b, false).truncate();
+                mustela::Val ck, cv;
+                assert(!c.get(&ck, &cv));
+                c.debug_check_cursor_path_up();
+            } else if (cmd == "vacuum") {
+                auto n = from_hex(get_nth_tok(tokens, 1)).at(0);
+                tx->vacuum(n);
+                for (auto& c: cursors) {
+                    c.second.debug_check_cursor_path_up();
+                }
             } else if (cmd == "commit") {
                 commit();
             } else if (cmd == "rollback") {
@@ -226,6 +410,14 @@ namespace {
             } else if (cmd == "rollback-reset") {
                 rollback();
                 reset();
+            } else if (cmd == "reopen") { // with dropped trees freed over several commits
+                drop_pages_per_commit = from_hex(get_nth_tok(tokens, 1)).at(0);
+                rollback();
+                reset();
+            } else if (cmd == "check-reader-heartbeat") {
+                check_reader_heartbeat();
+            } else if (cmd == "check-batch-conflicts") {
+                check_batch_conflicts();
             } else if (cmd == "kill") {
                 raise(SIGKILL);
             } else if (cmd == "noop") {
@@ -236,12 +428,27 @@ namespace {
                 std::string s1 = db_hash(*tx);
                 std::string s2 = get_nth_tok(tokens, 1);
                 assert(s1 == s2);
+            } else if (cmd == "ensure-contains") {
+                auto expected = !from_hex(get_nth_tok(tokens, 4)).empty();
+                auto& bucket = obtain_bucket(b, false);
+                mustela::Val value;
+                bool has = bucket.contains(mustela::Val(k));
+                bool found = bucket.get(mustela::Val(k), &value);
+                assert(has == expected && found == expected);
+                assert(!found || value == mustela::Val(v));
             } else if (cmd == "ensure-reader-hashes") {
                 for (size_t i = 1; i < tokens.size(); i++) {
                     std::string s1 = db_hash(*read_txs[i-1]);
                     std::string s2 = get_nth_tok(tokens, i);
                     assert(s1 == s2);
                 }
+            } else if (cmd == "ensure-reader-scan-hashes") {
+                auto count = from_hex(get_nth_tok(tokens, 1)).at(0);
+                for (size_t i = 2; i < tokens.size(); i++) {
+                    std::string s1 = db_scan_hash(*read_txs[i-2], count);
+                    std::string s2 = get_nth_tok(tokens, i);
+                    assert(s1 == s2);
+                }
             } else {
                 std::cerr << "unknown command:" << cmd << std::endl;
             }
@@ -8,21 +8,47 @@
 using namespace mustela;
 
 static const bool BULK_LOADING = true;
+static const Pid REFRESH_OLDEST_READER_PAGES = 64; // Look for finished readers after file grows by this number of pages
+static const Pid VACUUM_MIN_GAIN_PAGES = 64; // plus 1/64 of file, smaller gains are eaten by pages commits append to file
 
 static const char bucket_prefix = 'b';
+static const char drop_prefix = 'd'; // trees of dropped and truncated buckets, not freed yet
 
 int TX::debug_mirror_counter = 0;
 
 TX::TX(DB & my_db, bool read_only):my_db(my_db), read_only(read_only), page_size(my_db.page_size) {
 	if( !read_only && my_db.options.read_only)
 		Exception::th("Read-write transaction impossible on read-only DB");
-	my_db.start_transaction(this);
+	if( my_db.options.reader_heartbeat )
+		coarse_now = &my_db.core->coarse_now;
+	shared_snapshot = read_only && my_db.options.share_read_snapshots;
+	if( shared_snapshot )
+		attach_snapshot(my_db.get_current_snapshot());
+	else
+		my_db.core->start_transaction(this);
 	if(DEBUG_MIRROR)
 		load_mirror();
 }
 
+TX::TX(std::shared_ptr<Snapshot> snapshot):my_db(snapshot->my_db), read_only(true), page_size(my_db.page_size) {
+	attach_snapshot(snapshot);
+	if( my_db.options.reader_heartbeat )
+		coarse_now = &my_db.core->coarse_now;
+	if(DEBUG_MIRROR)
+		load_mirror();
+}
+
+void TX::attach_snapshot(std::shared_ptr<Snapshot> new_snapshot){
+	snapshot = new_snapshot;
+	c_file_ptr = snapshot->c_file_ptr;
+	file_page_count = snapshot->file_page_count;
+	meta_page = snapshot->meta_page;
+	reader_slot = snapshot->get_reader_slot();
+}
+
 TX::~TX(){
-	my_db.finish_transaction(this);
+	if(!snapshot && !shared_snapshot)
+		my_db.core->finish_transaction(this);
 	unlink_buckets_and_cursors();
 }
 DataPage * TX::writable_page(Pid page, Pid count){
@@ -44,7 +70,10 @@ char * TX::writable_overflow(Pid pa, Pid count){
 	return (char *)writable_page(pa, count);
 }
 void TX::mark_free_in_future_page(Pid page, Pid contigous_count, Tid page_tid){
-	free_list.mark_free_in_future_page(this, page, contigous_count, this->tid() == page_tid);
+	free_list.mark_free_in_future_page(this, page, contigous_count, page_tid);
+}
+void TX::punch_hole(Pid page, Pid contigous_count){
+	my_db.core->punch_hole(page, contigous_count);
 }
 void TX::start_update(BucketDesc * bucket_desc){
 	if(bucket_desc != &meta_page.meta_bucket)
@@ -61,15 +90,46 @@ void TX::finish_update(BucketDesc * bucket_desc){
 }
 
 void TX::update_reader_slot_slow(uint32_t now){
-	if( !my_db.reader_table.update_reader_slot(reader_slot, now, my_db.options.reader_timeout_seconds) )
+	if( parked )
+		Exception::th("Attempt to read from transaction after reset, call renew first");
+	if( snapshot ){
+		snapshot->update_reader_slot(now);
+		reader_slot.now = now;
+		return;
+	}
+	if( !my_db.core->reader_table.update_reader_slot(reader_slot, now, my_db.options.reader_timeout_seconds) )
 		Exception::th("Timeout in reader transaction - consider increasing read interval in DBOptions");
 }
 
-Pid TX::get_free_page(Pid contigous_count){
-	Pid pa = free_list.get_free_page(this, contigous_count, oldest_reader_tid, updating_meta_bucket);
+bool TX::refresh_oldest_reader(){
+	std::vector<Tid> new_live_reader_tids;
+	Tid new_oldest_reader_tid = my_db.core->refresh_oldest_reader_tid(this, &new_live_reader_tids);
+	bool changed = false;
+	if( new_oldest_reader_tid > oldest_reader_tid ){
+		oldest_reader_tid = new_oldest_reader_tid;
+		changed = true;
+	}
+	if( new_live_reader_tids != live_reader_tids ){
+		live_reader_tids.swap(new_live_reader_tids);
+		free_list.restart_young_records();
+		changed = true;
+	}
+	return changed;
+}
+Pid TX::get_free_page(Pid contigous_count, Pid hint){
+	if( vacuuming )
+		hint = 0;
+	Pid pa = free_list.get_free_page(this, contigous_count, oldest_reader_tid, updating_meta_bucket, hint);
+	if( !pa && !updating_meta_bucket && grown_page_count >= REFRESH_OLDEST_READER_PAGES ){
+		// Readers could finish while we were growing file, then pages they held can be reused
+		grown_page_count = 0;
+		if( refresh_oldest_reader() )
+			pa = free_list.get_free_page(this, contigous_count, oldest_reader_tid, updating_meta_bucket, hint);
+	}
 	if( !pa ){
+		grown_page_count += contigous_count;
 		if(meta_page.page_count + contigous_count > file_page_count)
-			my_db.grow_transaction(this, meta_page.page_count + contigous_count);
+			my_db.core->grow_transaction(this, meta_page.page_count + contigous_count);
 		ass(meta_page.page_count + contigous_count <= file_page_count, "grow_transaction failed to increase file size");
 		pa = meta_page.page_count;
 		meta_page.page_count += contigous_count;
@@ -88,7 +148,10 @@ DataPage * TX::make_pages_writable(Cursor & cur, size_t height){
 		return wr_dap;
 	}
 	mark_free_in_future_page(old_page, 1, dap->tid());
-	Pid new_page = get_free_page(1);
+	Pid hint = old_page;
+	if( height != cur.bucket_desc->height && cur.at(height + 1).item >= 0 ) // right after left sibling is best for scans
+		hint = readable_node(cur.at(height + 1).pid).get_value(cur.at(height + 1).item - 1) + 1;
+	Pid new_page = get_free_page(1, hint);
 	for(IntrusiveNode<Cursor> * c = &my_cursors; !c->is_end(); c = c->get_next(&Cursor::tx_cursors))
 		if( c->get_current()->bucket_desc == cur.bucket_desc && c->get_current()->at(height).pid == old_page )
 			c->get_current()->at(height).pid = new_page;
@@ -106,7 +169,7 @@ DataPage * TX::make_pages_writable(Cursor & cur, size_t height){
 }
 void TX::new_increase_height(Cursor & cur){
 	ass(cur.bucket_desc->height + 1 <= MAX_HEIGHT, "Maximum bucket height reached, congratulation!");
-	const Pid wr_root_pid = get_free_page(1);
+	const Pid wr_root_pid = get_free_page(1, cur.bucket_desc->root_page);
 	NodePtr wr_root = writable_node(wr_root_pid);
 	cur.bucket_desc->node_page_count += 1;
 	wr_root.init_dirty(meta_page.tid);
@@ -203,7 +266,7 @@ void TX::new_insert2node(Cursor & cur, size_t height, ValPid insert_kv1, ValPid
 			left_split = right_split - 1;
 		}
 	}
-	const Pid wr_right_pid = get_free_page(1);
+	const Pid wr_right_pid = get_free_page(1, path_el.pid + 1);
 	NodePtr wr_right = writable_node(wr_right_pid);
 	cur.bucket_desc->node_page_count += 1;
 	wr_right.init_dirty(meta_page.tid);
@@ -294,7 +357,7 @@ char * TX::new_insert2leaf(Cursor & cur, Val insert_key, size_t insert_value_siz
 		if( !right_sibling)
 			right_split = left_split = size_with_insert - 1;
 	}
-	const Pid wr_right_pid = get_free_page(1);
+	const Pid wr_right_pid = get_free_page(1, path_el.pid + 1);
 	LeafPtr wr_right = writable_leaf(wr_right_pid);
 	cur.bucket_desc->leaf_page_count += 1;
 	wr_right.init_dirty(meta_page.tid);
@@ -311,7 +374,7 @@ char * TX::new_insert2leaf(Cursor & cur, Val insert_key, size_t insert_value_siz
 	Pid wr_middle_pid = 0;
 	LeafPtr wr_middle;
 	if(left_split + 1 == right_split){
-		wr_middle_pid = get_free_page(1);
+		wr_middle_pid = get_free_page(1, path_el.pid + 1);
 		wr_middle = writable_leaf(wr_middle_pid);
 		cur.bucket_desc->leaf_page_count += 1;
 		wr_middle.init_dirty(meta_page.tid);
@@ -560,8 +623,13 @@ void TX::new_merge_leaf(Cursor & cur, LeafPtr wr_dap){
 void TX::commit(){
 	if(read_only)
 		return;
+	if( !meta_page_dirty && my_db.core->options.drop_pages_per_commit != 0 && has_dropped_trees() )
+		meta_page_dirty = true; // empty commits continue freeing dropped trees
 	if( meta_page_dirty ) {
 		Bucket meta_bucket = get_meta_bucket();
+		std::vector<std::pair<const std::string *, const BucketDesc *>> changed_descs;
+		for(auto && name : dropped_bucket_names)
+			changed_descs.push_back(std::make_pair(&name, nullptr));
 		for (auto &&tit : bucket_descs) { // First write all dirty table descriptions
 			CLeafPtr dap = readable_leaf(tit.second.root_page);
 			if (dap.page->tid() != meta_page.tid) // Table not dirty
@@ -571,11 +639,16 @@ void TX::commit(){
 			Val value(buf, sizeof(BucketDesc));
 			tit.second.pack(buf, sizeof(BucketDesc));
 			ass(meta_bucket.put(Val(key), value, false), "Writing table desc failed during commit");
+			changed_descs.push_back(std::make_pair(&tit.first, &tit.second));
 		}
-		free_list.commit_free_pages(this);
-		my_db.commit_transaction(this, meta_page);
+		free_dropped_trees(my_db.core->options.drop_pages_per_commit);
+		free_list.commit_free_pages(this, my_db.core->options.punch_hole_min_size != 0);
+		my_db.core->commit_transaction(this, meta_page);
+		my_db.core->commit_bucket_descs(meta_page.tid - 1, changed_descs); // commit moved us to the next tid
 	}
+	dropped_bucket_names.clear();
 	meta_page_dirty = false;
+	truncate_on_commit = false;
 }
 void TX::unlink_buckets_and_cursors(){
 	// Now invalidate all cursors and buckets
@@ -592,16 +665,51 @@ void TX::unlink_buckets_and_cursors(){
 		c->tx_buckets.unlink(&Bucket::tx_buckets);
 	}
 	bucket_descs.clear();
+	handle_descs.clear();
 }
 
+void TX::reset(){
+	if( !read_only || (snapshot && !shared_snapshot) )
+		Exception::th("Only read-only transaction can be reset");
+	unlink_buckets_and_cursors();
+	if(DEBUG_MIRROR)
+		debug_mirror.clear();
+	if( shared_snapshot ){ // last TX releases slot
+		snapshot.reset();
+		reader_slot.now = 0;
+		parked = true;
+		return;
+	}
+	// If we fail to park, slot was already grabbed and renew will get new one
+	my_db.core->reader_table.renew_reader_slot(reader_slot, std::numeric_limits<Tid>::max(), my_db.options.reader_timeout_seconds);
+	reader_slot.now = 0;
+	parked = true;
+}
+void TX::renew(){
+	if( !read_only || (snapshot && !shared_snapshot) )
+		Exception::th("Only read-only transaction can be renewed");
+	unlink_buckets_and_cursors();
+	parked = false;
+	if( shared_snapshot ){
+		snapshot.reset(); // so we do not keep old snapshot alive while getting current one
+		attach_snapshot(my_db.get_current_snapshot());
+	}else if( !my_db.core->renew_transaction(this) ){ // slot was grabbed or file outgrew our mapping
+		my_db.core->finish_transaction(this);
+		my_db.core->start_transaction(this);
+	}
+	if(DEBUG_MIRROR)
+		load_mirror();
+}
 void TX::rollback(){
 	if(read_only)
 		return;
 	free_list.clear();
+	dropped_bucket_names.clear();
 	meta_page_dirty = false;
-	my_db.finish_transaction(this);
+	truncate_on_commit = false;
+	my_db.core->finish_transaction(this);
 	unlink_buckets_and_cursors();
-	my_db.start_transaction(this);
+	my_db.core->start_transaction(this);
 	if(DEBUG_MIRROR)
 		load_mirror();
 }
@@ -635,6 +743,22 @@ Bucket TX::get_bucket(const Val & name, bool create_if_not_exists){
 	ass(!DEBUG_MIRROR || (debug_mirror.count(name.to_string()) != 0) == (bucket_desc != 0), "mirror violation in get_bucket");
 	return Bucket(this, bucket_desc, persistent_name);
 }
+Bucket TX::get_bucket(BucketHandle handle, bool create_if_not_exists){
+	if( handle.id < handle_descs.size() && handle_descs[handle.id].first ){
+		update_reader_slot();
+		return Bucket(this, handle_descs[handle.id].first, handle_descs[handle.id].second);
+	}
+	const std::string & name = my_db.core->get_bucket_name(handle);
+	Val persistent_name;
+	BucketDesc * bucket_desc = load_bucket_desc(Val(name), &persistent_name, create_if_not_exists, handle.id);
+	ass(!DEBUG_MIRROR || (debug_mirror.count(name) != 0) == (bucket_desc != 0), "mirror violation in get_bucket");
+	if( !bucket_desc )
+		return Bucket(this, nullptr);
+	if( handle.id >= handle_descs.size() )
+		handle_descs.resize(handle.id + 1);
+	handle_descs[handle.id] = std::make_pair(bucket_desc, persistent_name);
+	return Bucket(this, bucket_desc, persistent_name);
+}
 
 bool TX::drop_bucket(const Val & name){
 	if( read_only )
@@ -648,23 +772,13 @@ bool TX::drop_bucket(const Val & name){
 	if( !bucket_desc ){
 		return false;
 	}
-	{
-		// TODO - delete page by page
-		Cursor cursor(this, bucket_desc, persistent_name);
-		cursor.first();
-		while(bucket_desc->item_count != 0){
-			cursor.del();
-		}
-		ass(bucket_desc->leaf_page_count == 1 && bucket_desc->node_page_count == 0 && bucket_desc->overflow_page_count == 0 && bucket_desc->height == 0, "Bucket in wrong state after deleting all keys");
-		const DataPage * dap = readable_page(bucket_desc->root_page, 1);
-		mark_free_in_future_page(bucket_desc->root_page, 1, dap->tid());
-	}
+	detach_bucket_tree(*bucket_desc);
 	for(IntrusiveNode<Cursor> * cit = &my_cursors; !cit->is_end();){
 		Cursor * c = cit->get_current();
 		if( c->bucket_desc == bucket_desc ){
 			c->my_txn = nullptr;
 			c->bucket_desc = nullptr;
-			cit->unlink(&Cursor::tx_cursors);
+			c->tx_cursors.unlink(&Cursor::tx_cursors);
 		}else
 			cit = cit->get_next(&Cursor::tx_cursors);
 	}
@@ -675,7 +789,7 @@ bool TX::drop_bucket(const Val & name){
 		if( c->bucket_desc == bucket_desc ){
 			c->my_txn = nullptr;
 			c->bucket_desc = nullptr;
-			cit->unlink(&Bucket::tx_buckets);
+			c->tx_buckets.unlink(&Bucket::tx_buckets);
 		}else
 			cit = cit->get_next(&Bucket::tx_buckets);
 	}
@@ -683,9 +797,186 @@ bool TX::drop_bucket(const Val & name){
 	Bucket meta_bucket = get_meta_bucket();
 	ass(meta_bucket.del(Val(key)), "Error while dropping table");
 	ass(bucket_descs.erase(name.to_string()) == 1, "bucket_desc not found during erase");
+	handle_descs.clear();
+	dropped_bucket_names.push_back(name.to_string());
+	return true;
+}
+// Dropped tree record is root page, height and item in each node from root, where freeing continues
+static std::string pack_dropped_tree(Pid root_page, size_t height, const std::vector<int> & path){
+	std::string result(sizeof(uint64_t) * (2 + height), char(0));
+	char * buf = &result[0];
+	buf += pack_uint_le(buf, sizeof(uint64_t), root_page);
+	buf += pack_uint_le(buf, sizeof(uint64_t), height);
+	for(size_t he = height; he != 0; --he) // node items start from -1
+		buf += pack_uint_le(buf, sizeof(uint64_t), path.at(he - 1) + 1);
+	return result;
+}
+static void unpack_dropped_tree(Val value, Pid * root_page, size_t * height, std::vector<int> * path){
+	ass(value.size >= 2 * sizeof(uint64_t), "Wrong size of dropped tree record");
+	const char * buf = value.data;
+	uint64_t val = 0;
+	buf += unpack_uint_le(buf, sizeof(uint64_t), val);
+	*root_page = val;
+	buf += unpack_uint_le(buf, sizeof(uint64_t), val);
+	*height = val;
+	ass(value.size == sizeof(uint64_t) * (2 + *height), "Wrong size of dropped tree record");
+	path->assign(*height, -1);
+	for(size_t he = *height; he != 0; --he){
+		buf += unpack_uint_le(buf, sizeof(uint64_t), val);
+		path->at(he - 1) = int(val) - 1;
+	}
+}
+void TX::detach_bucket_tree(const BucketDesc & bucket_desc){
+	char keybuf[32];
+	keybuf[0] = drop_prefix;
+	size_t p1 = 1;
+	p1 += write_u64_sqlite4(tid(), keybuf + p1);
+	p1 += write_u64_sqlite4(bucket_desc.root_page, keybuf + p1); // root page is unique among trees not freed yet
+	const std::string value = pack_dropped_tree(bucket_desc.root_page, bucket_desc.height, std::vector<int>(bucket_desc.height, -1));
+	Bucket meta_bucket = get_meta_bucket();
+	ass(meta_bucket.put(Val(keybuf, p1), Val(value), true), "Dropped tree record already exists");
+}
+void TX::free_subtree(BucketDesc * bucket_desc, Pid pa, size_t height){
+	if( height == 0 ){
+		CLeafPtr dap = readable_leaf(pa);
+		for(int item = 0; item != dap.size(); ++item){
+			Pid overflow_page, overflow_count;
+			Tid overflow_tid;
+			dap.get_item_size(item, overflow_page, overflow_count, overflow_tid);
+			if( overflow_page == 0 )
+				continue;
+			bucket_desc->overflow_page_count -= overflow_count;
+			mark_free_in_future_page(overflow_page, overflow_count, overflow_tid);
+		}
+		bucket_desc->item_count -= dap.size();
+		bucket_desc->leaf_page_count -= 1;
+		mark_free_in_future_page(pa, 1, dap.page->tid());
+		return;
+	}
+	CNodePtr nap = readable_node(pa);
+	for(int item = -1; item != nap.size(); ++item)
+		free_subtree(bucket_desc, nap.get_value(item), height - 1);
+	bucket_desc->node_page_count -= 1;
+	mark_free_in_future_page(pa, 1, nap.page->tid());
+}
+void TX::erase_subtree(Cursor & cur, size_t height){
+	meta_page_dirty = true;
+	NodePtr wr_dap(page_size, (NodePage *)make_pages_writable(cur, height));
+	const auto path_el = cur.at(height);
+	ass(wr_dap.size() > 0, "Cannot erase the only child of node");
+	std::vector<Cursor *> inside;
+	for(IntrusiveNode<Cursor> * c = &my_cursors; !c->is_end(); c = c->get_next(&Cursor::tx_cursors)){
+		Cursor * cu = c->get_current();
+		if( cu->bucket_desc == cur.bucket_desc && !cu->is_before_first() && cu->at(height).pid == path_el.pid && cu->at(height).item == path_el.item )
+			inside.push_back(cu);
+	}
+	free_subtree(cur.bucket_desc, wr_dap.get_value(path_el.item), height - 1);
+	if( path_el.item == -1 ){ // next child becomes first
+		wr_dap.set_value(-1, wr_dap.get_value(0));
+		wr_dap.erase(0);
+	}else
+		wr_dap.erase(path_el.item);
+	for(IntrusiveNode<Cursor> * c = &my_cursors; !c->is_end(); c = c->get_next(&Cursor::tx_cursors))
+		c->get_current()->on_erase(cur.bucket_desc, height, path_el.pid, path_el.item);
+	for(auto cu : inside){
+		if( path_el.item < wr_dap.size() ){ // next child took place of erased one
+			cu->set_at_direction(height - 1, wr_dap.get_value(path_el.item), -1);
+		}else{ // erased last child, cursor points after end of previous one
+			cu->at(height).item = path_el.item - 1;
+			cu->set_at_direction(height - 1, wr_dap.get_value(path_el.item - 1), 1);
+		}
+	}
+	start_update(cur.bucket_desc);
+	new_merge_node(cur, height, wr_dap);
+	finish_update(cur.bucket_desc);
+}
+void TX::truncate_bucket(BucketDesc * bucket_desc){
+	meta_page_dirty = true;
+	detach_bucket_tree(*bucket_desc);
+	*bucket_desc = BucketDesc{};
+	bucket_desc->root_page = get_free_page(1);
+	LeafPtr wr_root = writable_leaf(bucket_desc->root_page);
+	wr_root.init_dirty(meta_page.tid);
+	bucket_desc->leaf_page_count = 1;
+	for(IntrusiveNode<Cursor> * cit = &my_cursors; !cit->is_end(); cit = cit->get_next(&Cursor::tx_cursors))
+		if( cit->get_current()->bucket_desc == bucket_desc )
+			cit->get_current()->before_first();
+}
+bool TX::walk_dropped_page(Pid pa, size_t height, std::vector<int> & path, Pid & budget, MergablePageCache * check_pages){
+	if( height == 0 ){
+		if( budget == 0 )
+			return false;
+		CLeafPtr dap = readable_leaf(pa);
+		Pid count = 1;
+		for(int item = 0; item != dap.size(); ++item){
+			Pid overflow_page, overflow_count;
+			Tid overflow_tid;
+			dap.get_item_size(item, overflow_page, overflow_count, overflow_tid);
+			if( overflow_page == 0 )
+				continue;
+			count += overflow_count;
+			if( check_pages )
+				check_pages->add_to_cache(overflow_page, overflow_count, 0);
+			else
+				mark_free_in_future_page(overflow_page, overflow_count, overflow_tid);
+		}
+		if( check_pages )
+			check_pages->add_to_cache(pa, 1, 0);
+		else
+			mark_free_in_future_page(pa, 1, dap.page->tid());
+		budget -= std::min(budget, count);
+		return true;
+	}
+	CNodePtr nap = readable_node(pa);
+	for(int & item = path.at(height - 1); item != nap.size(); ++item){
+		if( !walk_dropped_page(nap.get_value(item), height - 1, path, budget, check_pages) )
+			return false;
+		if( height > 1 )
+			path.at(height - 2) = -1; // next child from the start
+	}
+	if( check_pages )
+		check_pages->add_to_cache(pa, 1, 0);
+	else
+		mark_free_in_future_page(pa, 1, nap.page->tid());
 	return true;
 }
-BucketDesc * TX::load_bucket_desc(const Val & name, Val * persistent_name, bool create_if_not_exists){
+bool TX::has_dropped_trees(){
+	const Val prefix(&drop_prefix, 1);
+	Cursor cur(this, &meta_page.meta_bucket, Val{});
+	cur.seek(prefix);
+	Val c_key, c_value;
+	return cur.get(&c_key, &c_value) && c_key.has_prefix(prefix);
+}
+void TX::free_dropped_trees(Pid max_pages, MergablePageCache * check_pages){
+	Pid budget = max_pages == 0 ? std::numeric_limits<Pid>::max() : max_pages;
+	Bucket meta_bucket = get_meta_bucket();
+	const Val prefix(&drop_prefix, 1);
+	std::string next_key = prefix.to_string();
+	while( budget != 0 ){
+		std::string key;
+		Pid root_page = 0;
+		size_t height = 0;
+		std::vector<int> path;
+		{
+			Cursor cur = meta_bucket.get_cursor();
+			cur.seek(Val(next_key));
+			Val c_key, c_value;
+			if( !cur.get(&c_key, &c_value) || !c_key.has_prefix(prefix) )
+				break;
+			key = c_key.to_string();
+			unpack_dropped_tree(c_value, &root_page, &height, &path);
+		}
+		next_key = key + '\0'; // cursor cannot be kept, meta bucket changes
+		const bool finished = walk_dropped_page(root_page, height, path, budget, check_pages);
+		if( check_pages )
+			continue;
+		if( finished )
+			ass(meta_bucket.del(Val(key)), "Dropped tree record disappeared");
+		else
+			ass(meta_bucket.put(Val(key), Val(pack_dropped_tree(root_page, height, path)), false), "Dropped tree record not updated");
+	}
+}
+BucketDesc * TX::load_bucket_desc(const Val & name, Val * persistent_name, bool create_if_not_exists, uint32_t id){
 	update_reader_slot();
 	const std::string str_name = name.to_string();
 	auto tit = bucket_descs.find(str_name);
@@ -693,13 +984,24 @@ BucketDesc * TX::load_bucket_desc(const Val & name, Val * persistent_name, bool
 		*persistent_name = Val(tit->first);
 		return &tit->second;
 	}
+	// Writer sees meta bucket of previous tid, except buckets it dropped
+	const Tid cache_tid = read_only ? meta_page.tid : meta_page.tid - 1;
+	const bool use_cache = read_only || std::find(dropped_bucket_names.begin(), dropped_bucket_names.end(), str_name) == dropped_bucket_names.end();
+	BucketDesc cached_desc;
+	if( use_cache && my_db.core->get_cached_bucket_desc(str_name, &id, cache_tid, &cached_desc) ){
+		tit = bucket_descs.insert(std::make_pair(str_name, cached_desc)).first;
+		*persistent_name = Val(tit->first);
+		return &tit->second;
+	}
 	const std::string key = bucket_prefix + str_name;
 	Val value;
 	Bucket meta_bucket = get_meta_bucket();
 	if( meta_bucket.get(Val(key), &value) ){
-		tit = bucket_descs.insert(std::make_pair(name.to_string(), BucketDesc{})).first;
+		tit = bucket_descs.insert(std::make_pair(str_name, BucketDesc{})).first;
 		*persistent_name = Val(tit->first);
 		tit->second.unpack(value.data, value.size);
+		if( use_cache && id != std::numeric_limits<uint32_t>::max() )
+			my_db.core->set_cached_bucket_desc(id, cache_tid, tit->second);
 		return &tit->second;
 	}
 	if(!create_if_not_exists)
@@ -771,6 +1073,84 @@ void TX::check_bucket_page(const BucketDesc * bucket_desc, BucketDesc * stat_buc
 		check_bucket_page(bucket_desc, stat_bucket_desc, nap.get_value(pi), height - 1, prev_limit, next_limit, pages);
 	}
 }
+Pid TX::vacuum_bucket(Cursor & cur, Pid tail_page, Pid max_pages){
+	const Pid reserve = cur.bucket_desc->height + meta_page.meta_bucket.height + 8; // for copying path and meta bucket updates
+	Pid moved = 0;
+	for(cur.first(); moved < max_pages && cur.fix_cursor_after_last_item(); cur.next()){
+		if( !free_list.has_free_page_below(tail_page, reserve) )
+			break;
+		for(size_t height = 0; height <= cur.bucket_desc->height; ++height){
+			Pid pa = cur.at(height).pid;
+			if( pa < tail_page || readable_page(pa, 1)->tid() == tid() )
+				continue;
+			for(size_t he = height; he <= cur.bucket_desc->height; ++he) // path above will be moved, too
+				if( cur.at(he).pid >= tail_page && readable_page(cur.at(he).pid, 1)->tid() != tid() )
+					moved += 1;
+			meta_page_dirty = true;
+			make_pages_writable(cur, height);
+			break;
+		}
+		CLeafPtr dap = readable_leaf(cur.at(0).pid);
+		for(int item = 0; item != dap.size() && moved < max_pages; ++item){
+			Pid overflow_page, overflow_count;
+			Tid overflow_tid;
+			dap.get_item_size(item, overflow_page, overflow_count, overflow_tid);
+			if( overflow_page < tail_page )
+				continue;
+			Pid new_page = free_list.get_free_page_below(overflow_count, tail_page, meta_page.page_count);
+			if( new_page == 0 )
+				continue;
+			meta_page_dirty = true;
+			LeafPtr wr_dap(page_size, (LeafPage *)make_pages_writable(cur, 0));
+			memcpy(writable_overflow(new_page, overflow_count), readable_overflow(overflow_page, overflow_count), overflow_count * page_size);
+			wr_dap.set_overflow_page(item, new_page, tid());
+			mark_free_in_future_page(overflow_page, overflow_count, overflow_tid);
+			moved += overflow_count;
+			dap = wr_dap;
+		}
+		cur.at(0).item = dap.size() - 1; // next() moves to the next leaf
+	}
+	return moved;
+}
+bool TX::vacuum(Pid max_pages){
+	if( read_only )
+		Exception::th("Attempt to vacuum read-only transaction");
+	const Pid was_page_count = meta_page.page_count;
+	refresh_oldest_reader(); // readers could finish since our last commit
+	free_list.load_all_free_pages(this, oldest_reader_tid); // also cuts free pages at the end of file
+	// Pages freed by previous steps become free after meta pages referencing them are overwritten by next commits
+	MergablePageCache pending_pages(false);
+	free_list.get_pending_pages(this, &pending_pages);
+	const Pid free_count = free_list.get_free_page_count();
+	const bool worth = free_count + pending_pages.get_page_count() >= VACUUM_MIN_GAIN_PAGES + meta_page.page_count / 64;
+	// If all free pages were at the end, file would end at tail_page
+	const Pid tail_page = meta_page.page_count - free_count;
+	Pid moved = 0;
+	vacuuming = true;
+	if( worth && free_count != 0 ){
+		Cursor cur(this, &meta_page.meta_bucket, Val{});
+		start_update(cur.bucket_desc);
+		moved += vacuum_bucket(cur, tail_page, max_pages);
+		finish_update(cur.bucket_desc);
+		for(auto && name : get_bucket_names()){
+			if( moved >= max_pages )
+				break;
+			Bucket bucket = get_bucket(name, false);
+			Cursor bcur = bucket.get_cursor();
+			moved += vacuum_bucket(bcur, tail_page, max_pages - moved);
+		}
+	}
+	vacuuming = false;
+	// If some reader lags behind meta pages, commits will not help it, caller should call vacuum later
+	const bool waiting = worth && oldest_reader_tid >= earliest_meta_tid && pending_pages.get_page_count_from(tail_page - pending_pages.get_page_count()) != 0;
+	// Commit truncates file only to page_count of meta pages readers can use, so we need several commits
+	const bool truncate = oldest_reader_tid >= earliest_meta_tid && os::grow_to_granularity(meta_page.page_count * page_size, page_size, my_db.core->map_granularity) < file_page_count * page_size;
+	if( waiting || truncate || meta_page.page_count != was_page_count ){
+		meta_page_dirty = true; // commit will write meta page even if we moved nothing
+		truncate_on_commit = true;
+	}
+	return moved != 0 || waiting || truncate;
+}
 void TX::check_database(std::function<void(int percent)> on_progress, bool verbose){
 	MergablePageCache pages(false);
 	free_list.get_all_free_pages(this, &pages);
@@ -803,6 +1183,13 @@ void TX::check_database(std::function<void(int percent)> on_progress, bool verbo
         std::cerr << "All pages " << std::endl;
         pages.debug_print_db();
 	}
+	MergablePageCache dropped_pages(false);
+	free_dropped_trees(0, &dropped_pages);
+	if (verbose) {
+        std::cerr << "Pages of dropped trees " << std::endl;
+        dropped_pages.debug_print_db();
+	}
+	pages.merge_from(dropped_pages);
 	Pid remaining_pages = meta_page.page_count - pages.defrag_end(meta_page.page_count);
 	ass(pages.empty(), "After defrag free pages left");
 	ass(remaining_pages == META_PAGES_COUNT, "There should be exactly meta pages count left after removing everything from database");
@@ -813,6 +1200,9 @@ static std::string trim_key(const Val & key, bool parse_meta){
 	uint64_t next_record_batch;
 	if( parse_meta && FreeList::parse_free_record_key(key, &next_record_tid, &next_record_batch) )
 		return "f" + std::to_string(next_record_tid) + ":" + std::to_string(next_record_batch);
+	Tid birth_tid;
+	if( parse_meta && FreeList::parse_young_record_key(key, &next_record_tid, &birth_tid, &next_record_batch) )
+		return "g" + std::to_string(next_record_tid) + ":" + std::to_string(birth_tid) + ":" + std::to_string(next_record_batch);
 	std::string result;
 	for(auto && ch : key.to_string())
 		if( std::isprint(ch) && ch != '"' && ch != '\\' && ch != '<' && ch != '>' && ch != '{')
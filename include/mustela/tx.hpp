@@ -3,24 +3,38 @@
 #include <string>
 #include <map>
 #include <functional>
+#include <memory>
+#include <limits>
 #include "pages.hpp"
 #include "lock.hpp"
 #include "free_list.hpp"
 
 namespace mustela {
 	
+	struct BucketHandle { // see DB::get_bucket_handle
+		uint32_t id = std::numeric_limits<uint32_t>::max();
+	};
+
 	class TX {
 	public:
 		// We cannot have move semantic in TX for now because &meta_page.meta_bucket is stored in our cursors and buckets
 		explicit TX(DB & my_db, bool read_only = false);
+		explicit TX(std::shared_ptr<Snapshot> snapshot); // read-only TX, many threads can have TX on the same snapshot
 		~TX();
 		Tid tid()const{ return meta_page.tid; }
 		std::string get_meta_stats();
 
 		Bucket get_bucket(const Val & name, bool create_if_not_exists = true);
-		bool drop_bucket(const Val & name); // true if dropped, false if did not exist
+		Bucket get_bucket(BucketHandle handle, bool create_if_not_exists = true); // after first call in TX does not look at name
+		bool drop_bucket(const Val & name); // true if dropped, false if did not exist. Pages are freed on commit, see DBOptions::drop_pages_per_commit
 		std::vector<Val> get_bucket_names(); // sorted
 
+		// reset of read-only transaction invalidates buckets and cursors, keeps reader slot and mapping, but stops holding old pages
+		// renew of read-only transaction (also after reset) moves it to the newest snapshot, much faster than new TX
+		// not supported for write transactions and TX on Snapshot
+		void reset();
+		void renew();
+
 		// both rollback and commit of read-only transaction are nops
 		// commit of r/w transaction writes it to disk, everything remains valid for next commit, etc
 		// rollback of r/w transaction invalidates buckets and cursors, restarts r/w transaction
@@ -30,6 +44,11 @@ namespace mustela {
 		// Slow - reads all values
 		void check_database(std::function<void(int percent)> on_progress, bool verbose);
 
+		// Moves up to max_pages live pages from the end of file into free pages below, so the file can shrink
+		// Call in separate write TXs until it returns false, file is truncated during commit when
+		// no reader or older meta page references its end. Returns false if nothing can be done now
+		bool vacuum(Pid max_pages = 1024);
+
 		std::string debug_print_meta_db();
 		void debug_print_free_list(){
 			free_list.load_all_free_pages(this, oldest_reader_tid);
@@ -42,7 +61,10 @@ namespace mustela {
 		friend class Cursor;
 		friend class FreeList;
 		friend class Bucket;
-		friend class DB;
+		friend class Scanner;
+		friend class DBCore;
+		friend class Snapshot;
+		friend class WriteBatch;
 
 		DB & my_db;
 		// For readers & writers
@@ -51,24 +73,38 @@ namespace mustela {
 
 		const char * c_file_ptr = nullptr;
 		Pid file_page_count = 0;
-		size_t used_mapping_size = 0; // r-tx uses 1 mapping, w-tx uses all mappings larger than this
+		Mapping * c_mapping = nullptr; // r-tx references 1 mapping, w-tx references are in DB::wr_c_mappings
 		MetaPage meta_page;
 
 		// For readers
 		ReaderSlotDesc reader_slot;
+		const std::atomic<uint32_t> * coarse_now = nullptr; // set if DB has heartbeat thread
+		bool parked = false; // after reset(), reader_slot.now is 0, so we check it in update_reader_slot_slow
+		std::shared_ptr<Snapshot> snapshot; // reader_slot is a copy of snapshot slot, used only for fast check
+		bool shared_snapshot = false; // snapshot is DB current one, so we can reset and renew
+		void attach_snapshot(std::shared_ptr<Snapshot> new_snapshot);
 
 		// For writers
 		char * wr_file_ptr = nullptr;
 		Tid oldest_reader_tid = 0;
+		Tid earliest_meta_tid = 0;
+		std::vector<Tid> live_reader_tids; // sorted, pages born and freed between them can be reused
+		Pid grown_page_count = 0; // since oldest_reader_tid was computed last time
 		bool meta_page_dirty = false;
+		bool vacuuming = false; // allocate lowest free pages, ignoring hints
+		bool truncate_on_commit = false;
 		FreeList free_list;
 
 		std::map<std::string, BucketDesc> bucket_descs;
-		BucketDesc * load_bucket_desc(const Val & name, Val * persistent_name, bool create_if_not_exists);
+		std::vector<std::pair<BucketDesc *, Val>> handle_descs; // by BucketHandle::id, cleared together with bucket_descs
+		std::vector<std::string> dropped_bucket_names; // since last commit, their descs in DB cache are stale for us
+		BucketDesc * load_bucket_desc(const Val & name, Val * persistent_name, bool create_if_not_exists, uint32_t id = std::numeric_limits<uint32_t>::max());
 		Bucket get_meta_bucket();
 
-		Pid get_free_page(Pid contigous_count);
+		bool refresh_oldest_reader(); // true if more pages can be free for us
+		Pid get_free_page(Pid contigous_count, Pid hint = 0); // hint - page near which new page is good for scans
 		void mark_free_in_future_page(Pid page, Pid contigous_count, Tid page_tid); // associated with our tx, will be available after no read tx can ever use our tid
+		void punch_hole(Pid page, Pid contigous_count); // pages are free for all readers
 		bool updating_meta_bucket = false;
 		
 		void start_update(BucketDesc * bucket_desc);
@@ -76,13 +112,22 @@ namespace mustela {
 		void update_reader_slot(){
 			if( !read_only )
 				return;
-			uint32_t now = ReaderTable::now();
+			uint32_t now = coarse_now ? coarse_now->load(std::memory_order_relaxed) : ReaderTable::now();
 			if(now != reader_slot.now)
 				update_reader_slot_slow(now);
 		}
 		void update_reader_slot_slow(uint32_t now);
 
 		DataPage * make_pages_writable(Cursor & cur, size_t height);
+		// Trees of dropped and truncated buckets are kept in meta bucket until commits free all their pages
+		void detach_bucket_tree(const BucketDesc & bucket_desc);
+		void free_subtree(BucketDesc * bucket_desc, Pid pa, size_t height); // pages and items are subtracted from bucket_desc
+		void erase_subtree(Cursor & cur, size_t height); // child of node at height, cursors inside are set to next item
+		void truncate_bucket(BucketDesc * bucket_desc);
+		void free_dropped_trees(Pid max_pages, MergablePageCache * check_pages = nullptr); // 0 - no limit, if check_pages, collects pages without freeing
+		bool has_dropped_trees();
+		bool walk_dropped_page(Pid pa, size_t height, std::vector<int> & path, Pid & budget, MergablePageCache * check_pages); // false if budget ended
+		Pid vacuum_bucket(Cursor & cur, Pid tail_page, Pid max_pages); // returns number of moved pages
 		
 		void new_merge_node(Cursor & cur, size_t height, NodePtr wr_dap);
 		void new_merge_leaf(Cursor & cur, LeafPtr wr_dap);
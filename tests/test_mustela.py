@@ -82,6 +82,20 @@ class MustelaTestMachine(RuleBasedStateMachine):
     def same_reader_hashes(self):
         self.send('ensure-reader-hashes', *(db_hash(r) for r in self.readers))
 
+    @precondition(lambda self: self.readers)
+    @rule(count=st.integers(min_value=1, max_value=16))
+    def same_reader_scan_hashes(self, count):
+        self.send('ensure-reader-scan-hashes', count.to_bytes(length=1, byteorder='big'), *(db_hash(r) for r in self.readers))
+
+    @precondition(lambda self: self.db)
+    @rule(data=st.data())
+    def contains(self, data):
+        bucket = data.draw(st.sampled_from(list(self.db)), 'bucket')
+        kvs = self.db[bucket]
+        k = data.draw(st.one_of(st.sampled_from(list(kvs)), gen_key()) if kvs else gen_key(), 'key')
+        v = kvs.get(k)
+        self.send('ensure-contains', bucket, k, v or b'', b'' if v is None else b'\x01')
+
     @rule()
     def kill(self):
         self.db = clone_db(self.committed)
@@ -185,6 +199,59 @@ class MustelaTestMachine(RuleBasedStateMachine):
             del self.db[bucket][k]
         self.send('del-n-rev', bucket, key, n.to_bytes(length=1, byteorder='big'))
 
+    @precondition(lambda self: any(self.db.values()))
+    @rule(data=st.data())
+    def del_range(self, data):
+        bucket = data.draw(st.sampled_from(list(b for b, kvs in self.db.items() if kvs)), 'bucket')
+        keys = list(self.db[bucket])
+        begin = data.draw(st.one_of(st.sampled_from(keys), gen_key()), 'begin')
+        end = data.draw(st.one_of(st.sampled_from(keys), gen_key()), 'end')
+        cursor_key = data.draw(st.one_of(st.sampled_from(keys), gen_key()), 'cursor_key')
+        for k in list(self.db[bucket].irange(begin, end, inclusive=(True, False))):
+            del self.db[bucket][k]
+        self.send('del-range', bucket, begin, end, cursor_key)
+
+    @precondition(lambda self: self.db)
+    @rule(data=st.data(), op=st.sampled_from(['add', 'max', 'min', 'append', 'del']),
+          n=st.integers(min_value=-2**63, max_value=2**63-1), tail=st.binary(max_size=300))
+    def update(self, data, op, n, tail):
+        bucket = data.draw(st.sampled_from(list(self.db)), 'bucket')
+        kvs = self.db[bucket]
+        k = data.draw(st.one_of(st.sampled_from(list(kvs)), gen_key()) if kvs else gen_key(), 'key')
+        old = kvs.get(k)
+        arg = tail if op == 'append' else n.to_bytes(length=8, byteorder='little', signed=True)
+        if op == 'del':
+            kvs.pop(k, None)
+        elif op == 'append':
+            kvs[k] = (old or b'') + tail
+        elif old is None or len(old) == 8:  # other sizes throw and keep value
+            cur = None if old is None else int.from_bytes(old, byteorder='little', signed=True)
+            if op == 'add':
+                cur = ((cur or 0) + n + 2**63) % 2**64 - 2**63
+            elif op == 'max':
+                cur = n if cur is None or cur < n else cur
+            else:
+                cur = n if cur is None or cur > n else cur
+            kvs[k] = cur.to_bytes(length=8, byteorder='little', signed=True)
+        self.send('update', bucket, k, arg, op.encode('ascii'))
+
+    @precondition(lambda self: self.db)
+    @rule(data=st.data(), k=gen_key())
+    def truncate(self, data, k):
+        bucket = data.draw(st.sampled_from(list(self.db)), 'bucket')
+        self.db[bucket].clear()
+        self.send('truncate', bucket, k)
+
+    @rule(n=st.integers(min_value=0, max_value=8))
+    def reopen(self, n):
+        self.db = clone_db(self.committed)
+        self.readers = []
+        self.send('reopen', n.to_bytes(length=1, byteorder='big'))
+
+    @rule(n=st.integers(min_value=1, max_value=255))
+    def vacuum(self, n):
+        self.send('vacuum', n.to_bytes(length=1, byteorder='big'))
+
     @rule()
     def create_reader(self):
         self.readers.append(clone_db(self.committed))
@@ -193,3 +260,18 @@ class MustelaTestMachine(RuleBasedStateMachine):
 
 with settings(max_examples=100, stateful_step_count=100):
     TestMustela = MustelaTestMachine.TestCase
+
+
+def run_driver_check(cmd):
+    with tempfile.TemporaryDirectory() as dir_name:
+        r = subprocess.run([MUSTELA_BINARY, '--test', os.path.join(dir_name, MUSTELA_DB)], input=cmd + ',\n', stdout=subprocess.PIPE, encoding='utf-8')
+        assert r.returncode == 0
+        assert r.stdout == 'ok\n'
+
+
+def test_reader_heartbeat():
+    run_driver_check('check-reader-heartbeat')
+
+
+def test_batch_conflicts():
+    run_driver_check('check-batch-conflicts')